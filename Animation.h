@@ -0,0 +1,190 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    Animation.h - Compressed frame-stream animations played from LittleFS
+
+    An animation file starts with the magic "NXA1" and a 16 bit frame count,
+    followed by one record per frame. Each record only holds what changed
+    from the previous frame:
+
+      flags              bit 0 digits follow, bit 1 dots follow,
+                         bit 2 color follows, bit 3 duration is one byte
+      digits (3 bytes)   six 4 bit digits, NX1 in the high nibble of the first byte
+                         (0-9, 10 = blank)
+      dots (1 byte)      0 or 1
+      color (3 bytes)    red, green, blue
+      duration           1 or 2 bytes (little endian), milliseconds
+
+    Runs of identical frames are merged into one frame by the converter
+    (tools/make_animation.py). Files are decoded as they play through a
+    small fixed buffer, so they are never loaded whole.
+*/
+
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <LittleFS.h>
+#include "NixieTubeShield.h"
+
+#define ANIMATION_DIR         "/anim"
+#define ANIMATION_MAGIC       "NXA1"
+#define ANIMATION_BUFFER_SIZE 64
+
+#define ANIMATION_FLAG_DIGITS     0x01
+#define ANIMATION_FLAG_DOTS       0x02
+#define ANIMATION_FLAG_COLOR      0x04
+#define ANIMATION_FLAG_SHORT_TIME 0x08
+
+// Animation Class Definition
+class Animation {
+  public:
+    Animation(NixieTubeShield& shield) : _shield(shield) {
+    }
+
+    // Start playing an animation from the animation directory
+    bool play(const char* name) {
+      char path[48];
+      char magic[4];
+
+      stop();
+      snprintf(path, sizeof(path), "%s/%s", ANIMATION_DIR, name);
+      _file = LittleFS.open(path, "r");
+      if (!_file) {
+        Serial.print("Animation not found: ");
+        Serial.println(path);
+        return false;
+      }
+
+      _bufferLen = 0;
+      _bufferPos = 0;
+      for (int i = 0; i < 4; i++) {
+        magic[i] = readByte();
+      }
+      _frameCount = readByte() | (readByte() << 8);
+      if (memcmp(magic, ANIMATION_MAGIC, 4) != 0) {
+        Serial.println("Not an animation file");
+        _file.close();
+        return false;
+      }
+
+      _frames = 0;
+      _decodeUs = 0;
+      _decodeMaxUs = 0;
+      _nextFrameTime = millis();
+      _playing = true;
+      return true;
+    }
+
+    void stop() {
+      if (_file) {
+        _file.close();
+      }
+      if (_playing) {
+        _playing = false;
+        printStats();
+      }
+    }
+
+    bool isPlaying() {
+      return _playing;
+    }
+
+    // Show the next frame when it is due
+    void tick() {
+      if (!_playing || ((long) (millis() - _nextFrameTime) < 0)) {
+        return;
+      }
+
+      unsigned long startUs = micros();
+      int flags = readByte();
+      if (flags < 0) {
+        // End of file
+        stop();
+        return;
+      }
+
+      if (flags & ANIMATION_FLAG_DIGITS) {
+        for (int i = 0; i < 3; i++) {
+          int b = readByte();
+          _shield.setTubeDigit(i * 2, toDigit(b >> 4));
+          _shield.setTubeDigit(i * 2 + 1, toDigit(b));
+        }
+      }
+      if (flags & ANIMATION_FLAG_DOTS) {
+        _shield.dotsEnable(readByte() != 0);
+      }
+      if (flags & ANIMATION_FLAG_COLOR) {
+        int red = readByte();
+        int green = readByte();
+        int blue = readByte();
+        _shield.setLEDColor(red, green, blue);
+      }
+
+      unsigned int duration = readByte();
+      if (!(flags & ANIMATION_FLAG_SHORT_TIME)) {
+        duration |= readByte() << 8;
+      }
+      unsigned long decodeUs = micros() - startUs;
+
+      _shield.show();
+      _nextFrameTime += duration;
+
+      _frames++;
+      _decodeUs += decodeUs;
+      if (decodeUs > _decodeMaxUs) {
+        _decodeMaxUs = decodeUs;
+      }
+    }
+
+    // Print the decode cost per frame of the last animation
+    void printStats() {
+      Serial.print("Animation: ");
+      Serial.print(_frames);
+      Serial.print(" of ");
+      Serial.print(_frameCount);
+      Serial.print(" frames, decode (us/frame): avg ");
+      Serial.print(_frames ? _decodeUs / _frames : 0);
+      Serial.print(", max ");
+      Serial.println(_decodeMaxUs);
+    }
+
+  private:
+    // Digits outside 0-9 show as blank
+    static int toDigit(int nibble) {
+      nibble &= 0x0F;
+      return (nibble <= 9) ? nibble : BLANK_DIGIT;
+    }
+
+    // Next byte of the file, or -1 at the end of the file
+    int readByte() {
+      if (_bufferPos == _bufferLen) {
+        _bufferLen = _file.read(_buffer, sizeof(_buffer));
+        _bufferPos = 0;
+        if (_bufferLen <= 0) {
+          _bufferLen = 0;
+          return -1;
+        }
+      }
+      return _buffer[_bufferPos++];
+    }
+
+    // Instance of shield
+    NixieTubeShield& _shield;
+
+    File _file;
+    bool _playing = false;
+    unsigned long _nextFrameTime = 0;
+    unsigned int _frameCount = 0;
+
+    // Read buffer
+    uint8_t _buffer[ANIMATION_BUFFER_SIZE];
+    int _bufferLen = 0;
+    int _bufferPos = 0;
+
+    // Statistics for the current animation
+    unsigned long _frames = 0;
+    unsigned long _decodeUs = 0;
+    unsigned long _decodeMaxUs = 0;
+};
+
+#endif
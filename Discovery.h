@@ -0,0 +1,107 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    Discovery.h - mDNS/DNS-SD service advertisement
+
+    Each clock advertises a _nixieclock._tcp service with TXT records for
+    the firmware version, sync state and serial number. The service is only
+    registered once the HTTP server it points at is listening. The mDNS
+    responder answers from the registered records; the TXT records are only
+    rewritten when the sync state actually changes.
+*/
+
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <ESPmDNS.h>
+
+#define DISCOVERY_SERVICE  "nixieclock"
+#define DISCOVERY_PROTOCOL "tcp"
+
+// Discovery Class Definition
+class Discovery {
+  public:
+    // Start the responder once WiFi is connected. Safe to call repeatedly.
+    void begin() {
+      if (_started) {
+        return;
+      }
+      identify();
+
+      if (!MDNS.begin(_hostname)) {
+        Serial.println("mDNS responder failed to start");
+        return;
+      }
+      _started = true;
+
+      Serial.print("mDNS host name: ");
+      Serial.print(_hostname);
+      Serial.println(".local");
+
+      addService();
+    }
+
+    // Advertise the service once the HTTP server is listening on the port.
+    // Registered now if the responder is running, otherwise when it starts.
+    void advertise(uint16_t port, const char* firmwareVersion) {
+      _port = port;
+      _firmwareVersion = firmwareVersion;
+      addService();
+    }
+
+    // Update the advertised sync state if it has changed
+    void update(const char* syncSource) {
+      if (strcmp(syncSource, _syncSource) == 0) {
+        return;
+      }
+      strlcpy(_syncSource, syncSource, sizeof(_syncSource));
+      if (_advertised) {
+        MDNS.addServiceTxt(DISCOVERY_SERVICE, DISCOVERY_PROTOCOL, "sync", _syncSource);
+      }
+    }
+
+    const char* getHostname() {
+      identify();
+      return _hostname;
+    }
+
+    const char* getSerial() {
+      identify();
+      return _serial;
+    }
+
+  private:
+    void addService() {
+      if (!_started || (_port == 0) || _advertised) {
+        return;
+      }
+      MDNS.addService(DISCOVERY_SERVICE, DISCOVERY_PROTOCOL, _port);
+      MDNS.addServiceTxt(DISCOVERY_SERVICE, DISCOVERY_PROTOCOL, "fw", _firmwareVersion);
+      MDNS.addServiceTxt(DISCOVERY_SERVICE, DISCOVERY_PROTOCOL, "serial", _serial);
+      MDNS.addServiceTxt(DISCOVERY_SERVICE, DISCOVERY_PROTOCOL, "sync", _syncSource);
+      _advertised = true;
+    }
+
+    // Serial number and host name are derived from the factory MAC
+    void identify() {
+      if (_serial[0] != 0) {
+        return;
+      }
+      uint8_t mac[6];
+      esp_efuse_mac_get_default(mac);
+      snprintf(_serial, sizeof(_serial), "%02X%02X%02X%02X%02X%02X",
+               mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+      snprintf(_hostname, sizeof(_hostname), "nixieclock-%02x%02x%02x",
+               mac[3], mac[4], mac[5]);
+    }
+
+    bool _started = false;
+    bool _advertised = false;
+    uint16_t _port = 0;
+    const char* _firmwareVersion = "";
+    char _hostname[24] = "";
+    char _serial[13] = "";
+    char _syncSource[8] = "none";
+};
+
+#endif
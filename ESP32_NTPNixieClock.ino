@@ -20,12 +20,88 @@
     to be entered. This only needs to be done once since the credentials will be stored in
     EEPROM and will be used from that point forward.
 
+    Credentials for up to five networks are remembered. At connect time the clock scans
+    once and tries the known networks strongest first, moving on to the next network
+    after repeated failures. Only the first connection at boot is waited for;
+    reconnects run in the background so the display keeps running.
+
     Once WiFi connection has been established, it uses NTP to initialize the real-time clock (RTC).
+    NTP servers announced by DHCP (option 42) are used first, with public servers ranked by
+    round trip time as a fallback.
     If ESP32 cannot connect to the WiFi network using the stored crecentials, it will fall back
     to the real-time clock (RTC).
 
     Press the mode button to enter WiFi AP configuration mode.
     Long-press the mode button to reset the ESP32.
+    Long-press the up button to download and install a firmware update.
+
+    Each clock advertises itself over mDNS/DNS-SD as a _nixieclock._tcp service
+    so a fleet of clocks can be found without looking up their IP addresses.
+
+    Optionally, the clock publishes telemetry to an MQTT broker and accepts
+    commands on nixieclock/<serial>/cmd:
+      sync                 Sync time from NTP now
+      antipoison           Run the anti-poisoning routine
+      update               Download and install a firmware update
+      restart              Restart the ESP32
+      effect               Play the user effect
+      stop                 Stop the user effect or animation
+      play <name>          Play an animation
+      record start|stop    Start or stop recording inputs
+      fault <scenario>     Run a fault injection scenario (see FaultInjection.h)
+      set <name> <value>   Change a setting (hour12, zeros, on_hour,
+                           off_hour, motion_hold, brightness, color)
+
+    The same settings and actions are available as a JSON API:
+      curl http://<clock>/api
+      curl -H "Content-Type: application/json" \
+           --data '{"set":{"brightness":128,"color":16711680},"action":"sync"}' http://<clock>/api
+    Actions are sync, antipoison, effect, stop, play (with "name"), update and
+    restart.
+
+    User effects are bytecode programs (see EffectVM.h) uploaded as hex text:
+      curl -H "Content-Type: text/plain" \
+           --data "0A0000 0710 0500 0B0010 066400 08 00" http://<clock>/effect
+      curl -X POST http://<clock>/effect/run
+      curl -X POST http://<clock>/effect/stop
+    Effects stop when the clock turns off, and after ten minutes at most.
+
+    Longer animations are stored in LittleFS as compressed frame streams (see
+    Animation.h). Convert them with tools/make_animation.py, then:
+      curl -F "file=@intro.nxa" http://<clock>/anim
+      curl -X POST "http://<clock>/anim/play?name=intro.nxa"
+      curl -X POST http://<clock>/anim/stop
+    Animations stop when the clock turns off.
+
+    For reproducing timing problems, the local inputs (buttons, NTP responses,
+    RTC reads, WiFi events, PIR motion, second timer fires) can be recorded to
+    LittleFS (see InputRecorder.h) and downloaded for offline analysis. Remote
+    commands and setting changes are not recorded.
+      curl -X POST http://<clock>/record/start
+      curl -X POST http://<clock>/record/stop
+      curl -o record.bin http://<clock>/record
+
+    An optional PIR motion sensor keeps the tubes off in an empty room. The tubes
+    are lit for a hold time after the last motion and fade out afterwards.
+
+    Power management scales the CPU clock down between display updates. Full
+    speed is only requested around SPI frame pushes and network activity, so
+    the tubes still flip right on the second. The PWM outputs hold the APB
+    clock while the tubes are lit, so the clock only light sleeps while they
+    are off. The reported current is an estimate from the PM_CURRENT_*
+    figures, not a measurement.
+
+    Heavy background jobs wait for the hours the clock is scheduled off (see
+    Maintenance.h): calibrating the RTC against NTP, saving the tube-life
+    counters and, with OTA_NIGHTLY_CHECK, installing new firmware. The CPU and
+    network time of each run is printed and shown by GET /api.
+
+    When the supply sags, the brownout detector or an optional 12 V rail sense
+    (SUPPLY_SENSE_PIN) saves the displayed second to RTC memory and turns the
+    high voltage off (see PowerFail.h). If the ESP32 resets, the next boot
+    resumes the display from the RTC within milliseconds, before WiFi connects,
+    and skips the anti-poisoning routine. GET /api reports the number of saves
+    since power on and the resume time.
 
     The hardware consists of the following parts:
       ESP32
@@ -74,6 +150,9 @@
     CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+// Uncomment to build in fault injection for reliability testing
+// #define FAULT_INJECTION
+
 #include <driver/dac.h>
 #include <WiFi.h>
 #include <SPI.h>
@@ -82,10 +161,27 @@
 #include <DNSServer.h>
 #include <WebServer.h>
 #include <WiFiManager.h>
+#include <Preferences.h>
 
 #include "LEDControl.h"
+#include "Animation.h"
+#include "Discovery.h"
+#include "EffectVM.h"
+#include "FaultInjection.h"
+#include "InputRecorder.h"
+#include "JsonTokenizer.h"
+#include "Maintenance.h"
 #include "NixieTubeShield.h"
 #include "NTP.h"
+#include "Occupancy.h"
+#include "OTAUpdate.h"
+#include "PowerFail.h"
+#include "PowerManagement.h"
+#include "Settings.h"
+#include "Telemetry.h"
+#include "WiFiNetworks.h"
+
+#define FIRMWARE_VERSION "1.1.0"
 
 // ***************************************************************
 // Start of user configuration items
@@ -98,6 +194,30 @@
 #define WIFI_CHK_TIME_SEC 3600
 #define WIFI_CHK_TIME_MS  (WIFI_CHK_TIME_SEC * 1000)
 
+// Retry interval while WiFi is not connected
+#define WIFI_RETRY_TIME_SEC 60
+#define WIFI_RETRY_TIME_MS  (WIFI_RETRY_TIME_SEC * 1000)
+
+// Connection attempts per known network, and time allowed for each
+#define WIFI_ATTEMPTS_PER_NETWORK 2
+#define WIFI_ATTEMPT_TIMEOUT_MS   10000
+
+// Location of firmware updates. The SHA-256 file holds the hex digest
+// of the firmware image.
+#define OTA_FIRMWARE_URL "http://192.168.1.10/nixieclock/firmware.bin"
+#define OTA_SHA256_URL   "http://192.168.1.10/nixieclock/firmware.sha256"
+
+// Check for new firmware every night and install it
+#define OTA_NIGHTLY_CHECK false
+
+// Port of the clock's HTTP endpoints, advertised over mDNS
+#define HTTP_PORT 80
+
+// MQTT broker for telemetry and commands. Leave the host empty to disable.
+#define MQTT_HOST ""
+#define MQTT_PORT 1883
+#define MQTT_TELEMETRY_INTERVAL_SEC 60
+
 // Set to false for 24 hour time mode
 #define HOUR_FORMAT_12 true
 
@@ -106,10 +226,37 @@
 #define CLOCK_OFF_HOUR 23
 #define CLOCK_ON_HOUR  07
 
+// Optional PIR motion sensor input. Set to -1 if no sensor is fitted.
+// Tubes stay lit for MOTION_HOLD_MIN minutes after the last motion.
+#define MOTION_SENSOR_PIN -1
+#define MOTION_HOLD_MIN   15
+#define HV_FADE_MS        1000
+
+// Power management: CPU frequency range and automatic light sleep
+#define PM_MAX_FREQ_MHZ     240
+#define PM_MIN_FREQ_MHZ     40
+#define PM_LIGHT_SLEEP      true
+#define PM_REPORT_INTERVAL_SEC 3600
+#define PM_REPORT_INTERVAL_MS  (PM_REPORT_INTERVAL_SEC * 1000)
+
+// Optional 12 V supply sense: ADC pin on a divider from the 12 V rail,
+// -1 if not fitted. The state is saved and the high voltage turned off
+// when the rail falls below SUPPLY_FAIL_MV. Must be an ADC1 pin
+// (GPIO 32-39): ADC2 cannot be read while WiFi is on.
+#define SUPPLY_SENSE_PIN   -1
+#define SUPPLY_SENSE_RATIO 5.7   // 47k over 10k divider
+#define SUPPLY_FAIL_MV     10500
+
+// A state saved longer ago than this is not resumed from
+#define RESUME_MAX_AGE_SEC 60
+
 // Suppress leading zeros
 // Set to false to having leading zeros displayed
 #define SUPPRESS_LEADING_ZEROS true
 
+// LED brightness, 0 to 255
+#define LED_BRIGHTNESS 255
+
 // Define the timezone in which the clock will operate
 // See the Timezone library for details
 // US Pacific Time Zone (Las Vegas, Los Angeles)
@@ -124,6 +271,33 @@ Timezone TZ(usPDT, usPST);
 // Instantiate the Nixie Tube Shield object
 NixieTubeShield SHIELD;
 
+// Instantiate the occupancy (motion sensor) object
+Occupancy OCCUPANCY;
+
+// Instantiate the firmware update object
+OTAUpdate OTA;
+
+// Instantiate the mDNS service advertisement object
+Discovery DISCOVERY;
+
+// Instantiate the run-time settings object
+Settings SETTINGS;
+
+// Instantiate the MQTT telemetry object
+Telemetry TELEMETRY;
+
+// Instantiate the user effect interpreter
+EffectVM EFFECT(SHIELD);
+
+// Instantiate the animation player
+Animation ANIMATION(SHIELD);
+
+// Instantiate the HTTP server for the clock's endpoints
+WebServer WEBSERVER(HTTP_PORT);
+
+// Instantiate the known WiFi networks object
+WiFiNetworks WIFI_NETWORKS;
+
 // Instantiate the WifiManager object
 WiFiManager wifiManager;
 
@@ -136,9 +310,35 @@ int previousMinute = 0;
 int minutes = 0;
 boolean dotToggle = false;
 boolean clockOn = true;
+boolean clockScheduledOn = true;
+
+// Time taken by the last WiFi connection attempt
+unsigned long wifiConnectTime = 0;
+
+// Set while the display resumed after a supply failure is kept running
+// during setup, and the time it took to resume
+boolean displayResumed = false;
+unsigned long resumeTime = 0;
+
+// Blank the tubes, dots and LEDs once the high voltage is off
+void blankDisplay(void) {
+  // First turn off the dots
+  SHIELD.dotsEnable(false);
+  SHIELD.setNX1Digit(BLANK_DIGIT);
+  SHIELD.setNX2Digit(BLANK_DIGIT);
+  SHIELD.setNX3Digit(BLANK_DIGIT);
+  SHIELD.setNX4Digit(BLANK_DIGIT);
+  SHIELD.setNX5Digit(BLANK_DIGIT);
+  SHIELD.setNX6Digit(BLANK_DIGIT);
+  SHIELD.show();
+
+  // Finally turn the LEDs off as well
+  SHIELD.setLEDColor(black);
+}
 
-// This function is called once a second
-void updateDisplay(void) {
+// This function is called once a second. Returns true if a frame showing
+// the time was latched.
+bool updateDisplay(void) {
 
   // Get the current time and date
   // Get the time for specified timezone
@@ -147,11 +347,14 @@ void updateDisplay(void) {
   // Determine if clock should be on or off
   int hr = hour(localTime);
 
-  // Clock is on between these hours
-  if ((hr >= CLOCK_ON_HOUR) && (hr < CLOCK_OFF_HOUR)) {
+  // Clock is on between these hours and while the room is occupied
+  clockScheduledOn = (hr >= SETTINGS.clockOnHour) && (hr < SETTINGS.clockOffHour);
+  if (clockScheduledOn && OCCUPANCY.isOccupied()) {
     if (!clockOn) {
       clockOn = true;
       Serial.println("Clock is On");
+      TELEMETRY.event("clock_on");
+      OCCUPANCY.printCounters();
 
       // Clock should be on so turn high voltage on
       SHIELD.hvEnable(true);
@@ -160,28 +363,33 @@ void updateDisplay(void) {
     if (clockOn) {
       clockOn = false;
 
+      // A running effect or animation must not keep the tubes lit
+      EFFECT.stop();
+      ANIMATION.stop();
+
       Serial.println("Clock is Off");
+      TELEMETRY.event(clockScheduledOn ? "clock_vacant" : "clock_off");
+      OCCUPANCY.printCounters();
 
       // Clock is going off so shut things down in an orderly fashion
-      // First turn off the high voltage so the nixie's go off
-      SHIELD.hvEnable(false);
-
-      // Next turn off the dots
-      SHIELD.dotsEnable(false);
-      SHIELD.setNX1Digit(BLANK_DIGIT);
-      SHIELD.setNX2Digit(BLANK_DIGIT);
-      SHIELD.setNX3Digit(BLANK_DIGIT);
-      SHIELD.setNX4Digit(BLANK_DIGIT);
-      SHIELD.setNX5Digit(BLANK_DIGIT);
-      SHIELD.setNX6Digit(BLANK_DIGIT);
-      SHIELD.show();
-
-      // Finally turn the LEDs off as well
-      SHIELD.setLEDColor(black);
+      // First turn off the high voltage so the nixie's go off.
+      // Fade out when the room became empty. The tubes keep showing the
+      // time while they fade and loop() blanks them once it is done.
+      if (clockScheduledOn) {
+        SHIELD.hvFade(false, HV_FADE_MS);
+      } else {
+        SHIELD.hvEnable(false);
+        blankDisplay();
+      }
     }
 
     // No need to continue as the clock is effectively off
-    return;
+    return false;
+  }
+
+  // A running effect or animation owns the tubes until it ends
+  if (EFFECT.isRunning() || ANIMATION.isPlaying()) {
+    return false;
   }
 
   // Get the current minute
@@ -247,7 +455,7 @@ void updateDisplay(void) {
     if (now_mon >= 10) {
       SHIELD.setNX1Digit(now_mon / 10);
     } else  {
-      if (SUPPRESS_LEADING_ZEROS) {
+      if (SETTINGS.suppressLeadingZeros) {
         SHIELD.setNX1Digit(BLANK_DIGIT);
       } else  {
         SHIELD.setNX1Digit(0);
@@ -263,7 +471,7 @@ void updateDisplay(void) {
     if (now_day >= 10) {
       SHIELD.setNX3Digit(now_day / 10);
     } else  {
-      if (SUPPRESS_LEADING_ZEROS) {
+      if (SETTINGS.suppressLeadingZeros) {
         SHIELD.setNX3Digit(BLANK_DIGIT);
       } else  {
         SHIELD.setNX3Digit(0);
@@ -279,7 +487,7 @@ void updateDisplay(void) {
     if (now_year >= 10) {
       SHIELD.setNX5Digit(now_year / 10);
     } else  {
-      if (SUPPRESS_LEADING_ZEROS) {
+      if (SETTINGS.suppressLeadingZeros) {
         SHIELD.setNX5Digit(BLANK_DIGIT);
       } else  {
         SHIELD.setNX5Digit(0);
@@ -312,7 +520,7 @@ void updateDisplay(void) {
 
     // Set the LED's color depending upon the hour
     // Get the current hour
-    if (HOUR_FORMAT_12) {
+    if (SETTINGS.hourFormat12) {
       // Using 12 hour format
       now_hour = hourFormat12(localTime);
       // Calculate the color of the LEDs based on the hour in 12 hour format
@@ -324,13 +532,17 @@ void updateDisplay(void) {
       colorInc = 256 / 24.0;
     }
     // Set the shields's LED color
-    SHIELD.setLEDColor(SHIELD.colorWheel(colorInc * now_hour));
+    if (SETTINGS.ledColor >= 0) {
+      SHIELD.setLEDColor(SETTINGS.ledColor >> 16, SETTINGS.ledColor >> 8, SETTINGS.ledColor);
+    } else {
+      SHIELD.setLEDColor(SHIELD.colorWheel(colorInc * now_hour));
+    }
 
     // Display the NX1 digit
     if (now_hour >= 10) {
       SHIELD.setNX1Digit(now_hour / 10);
     } else  {
-      if (SUPPRESS_LEADING_ZEROS) {
+      if (SETTINGS.suppressLeadingZeros) {
         SHIELD.setNX1Digit(BLANK_DIGIT);
       } else  {
         SHIELD.setNX1Digit(0);
@@ -359,9 +571,120 @@ void updateDisplay(void) {
 
     // Display time on clock
     SHIELD.show();
+    return true;
+  }
+  return false;
+}
+
+// Handle a command received over MQTT
+void processCommand(const char* command) {
+  char name[32];
+  long value;
+
+  Serial.print("Command: ");
+  Serial.println(command);
+
+  if (strcmp(command, "sync") == 0) {
+    forceNTPSync();
+  } else if (strcmp(command, "antipoison") == 0) {
+    if (clockOn) {
+      SHIELD.doAntiPoisoning();
+    }
+  } else if (strcmp(command, "update") == 0) {
+    OTA.start(OTA_FIRMWARE_URL, OTA_SHA256_URL);
+  } else if (strcmp(command, "restart") == 0) {
+    esp_restart();
+  } else if (strcmp(command, "effect") == 0) {
+    if (clockOn) {
+      EFFECT.start();
+    }
+  } else if (strcmp(command, "stop") == 0) {
+    EFFECT.stop();
+    ANIMATION.stop();
+  } else if (strcmp(command, "record start") == 0) {
+    RECORDER.start();
+  } else if (strcmp(command, "record stop") == 0) {
+    RECORDER.stop();
+  } else if (sscanf(command, "fault %31s", name) == 1) {
+    if (!FAULTS.start(name)) {
+      Serial.println("Unknown fault scenario or fault injection not built in");
+    }
+  } else if (sscanf(command, "play %31s", name) == 1) {
+    if (clockOn) {
+      ANIMATION.play(name);
+    }
+  } else if ((sscanf(command, "set %31s %ld", name, &value) == 2) && SETTINGS.set(name, value)) {
+    OCCUPANCY.setHoldTime(SETTINGS.motionHoldMin * 60UL);
+    SHIELD.setLEDBrightness(SETTINGS.ledBrightness);
+  } else {
+    Serial.println("Unknown command");
   }
 }
 
+// ***************************************************************
+// Supply failure save and fast resume
+// ***************************************************************
+
+// After a supply failure, show the time from the RTC right away.
+// Returns false on a cold boot or if the saved state is stale.
+bool RESUME_Display() {
+  time_t savedTime;
+  tmElements_t tm;
+
+  if (!POWERFAIL.takeSavedTime(savedTime) || !SHIELD.getRTCTime(tm)) {
+    return false;
+  }
+  time_t rtcTime = makeTime(tm);
+  if ((rtcTime < savedTime) || ((rtcTime - savedTime) > RESUME_MAX_AGE_SEC)) {
+    Serial.println("Saved state is stale");
+    return false;
+  }
+  setTime(rtcTime);
+  POWER.timeSet();
+
+  // Off, so the display turns the high voltage on if it is due
+  clockOn = false;
+  updateDisplay();
+  resumeTime = esp_timer_get_time() / 1000;
+
+  Serial.print("Resumed after supply failure: outage (s) ");
+  Serial.print(rtcTime - savedTime);
+  Serial.print(", resume (ms) ");
+  Serial.print(resumeTime);
+  Serial.print(", saves ");
+  Serial.println(POWERFAIL.getSaveCount());
+  return true;
+}
+
+// Wait while keeping the resumed display running
+void RESUME_Wait(unsigned long ms) {
+  static int lastSecond = -1;
+  unsigned long startTime = millis();
+
+  while ((millis() - startTime) < ms) {
+    if (second() != lastSecond) {
+      lastSecond = second();
+      updateDisplay();
+    }
+    delay(10);
+  }
+}
+
+// Queue a telemetry message with the events and metrics of the last interval
+void publishTelemetry() {
+  char metrics[224];
+  NTP& ntp = NTP::getInstance();
+
+  snprintf(metrics, sizeof(metrics),
+           "\"uptime\":%lu,\"rssi\":%d,\"sync\":\"%s\",\"last_sync\":%ld,"
+           "\"clock_on\":%d,\"tube_on_s\":%lu,\"saved_s\":%lu,\"heap\":%u,\"wifi_connect_ms\":%lu",
+           millis() / 1000, WiFi.RSSI(), ntp.getSyncSource(), (long) ntp.getLastSyncTime(),
+           clockOn, OCCUPANCY.getTubeOnSeconds(), OCCUPANCY.getSavedSeconds(), ESP.getFreeHeap(),
+           wifiConnectTime);
+
+  TELEMETRY.publishBatch(now(), metrics);
+}
+
 // Get WiFi SSID
 String WIFI_GetSSID() {
   wifi_config_t conf;
@@ -376,40 +699,520 @@ String WIFI_GetPassword() {
   return String(reinterpret_cast<const char*>(conf.sta.password));
 }
 
-// Attempt to connect to WiFi
-void WIFI_Connect() {
-  WiFi.disconnect();
-  Serial.println("Connecting to WiFi...");
-  WiFi.begin(WIFI_GetSSID().c_str(), WIFI_GetPassword().c_str());
-
-  for (int i = 0; i < 40; i++) {
-    if (WiFi.status() != WL_CONNECTED) {
-      delay (250);
-      SHIELD.setLEDColor(black);
-      Serial.print(".");
-      delay (250);
-      SHIELD.setLEDColor(green);
-    } else {
-      break;
-    }
+// WiFi connection state. Connecting is advanced from the main loop, so the
+// display keeps running while the clock scans and tries each network.
+enum WiFiConnectState { WIFI_IDLE, WIFI_SCANNING, WIFI_CONNECTING };
+WiFiConnectState wifiState = WIFI_IDLE;
+int wifiCandidates = 0;
+int wifiCandidate = 0;
+int wifiAttempt = 0;
+unsigned long wifiAttemptStart = 0;
+
+bool WIFI_IsConnecting() {
+  return wifiState != WIFI_IDLE;
+}
+
+// Start connecting to one of the scanned candidate networks
+void WIFI_BeginCandidate(int c) {
+  const WiFiNetworks::Candidate& candidate = WIFI_NETWORKS.getCandidate(c);
+  const WiFiNetworks::Network& network = WIFI_NETWORKS.getNetwork(candidate.network);
+  bool seen = (candidate.rssi != INT32_MIN);
+
+  Serial.print("Trying ");
+  Serial.print(network.ssid);
+  if (seen) {
+    Serial.print(" (RSSI ");
+    Serial.print(candidate.rssi);
+    Serial.print(")");
+  }
+  Serial.println();
+
+  wifiAttemptStart = millis();
+  if (seen) {
+    WiFi.begin(network.ssid, network.password, candidate.channel, candidate.bssid);
+  } else {
+    WiFi.begin(network.ssid, network.password);
   }
-  
+  wifiState = WIFI_CONNECTING;
+}
+
+// End the connection attempt
+void WIFI_Finish() {
   if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("");
     Serial.println("WiFi Connected");
     Serial.println("IP address: ");
     Serial.println(WiFi.localIP());
+
+    // Advertise the clock on the local network
+    DISCOVERY.begin();
   } else {
     Serial.println("Wifi NOT connected");
+
+    // Networks may have moved, scan again next time
+    WIFI_NETWORKS.invalidateScan();
+  }
+  wifiState = WIFI_IDLE;
+  netPMLock.release();
+}
+
+// Start connecting to WiFi. WIFI_Poll() does the rest.
+void WIFI_Connect() {
+  if (WIFI_IsConnecting()) {
+    return;
+  }
+  netPMLock.acquire();
+  WiFi.disconnect();
+  Serial.println("Connecting to WiFi...");
+
+  // Strongest known network first, move on after repeated failures
+  WIFI_NETWORKS.startScan();
+  wifiCandidate = 0;
+  wifiAttempt = 0;
+  wifiState = WIFI_SCANNING;
+}
+
+// Advance the connection attempt. Returns true when it has just finished.
+bool WIFI_Poll() {
+  switch (wifiState) {
+    case WIFI_IDLE:
+      return false;
+
+    case WIFI_SCANNING:
+      wifiCandidates = WIFI_NETWORKS.scanResult();
+      if (wifiCandidates < 0) {
+        return false;
+      }
+      if (wifiCandidates == 0) {
+        WIFI_Finish();
+        return true;
+      }
+      WIFI_BeginCandidate(0);
+      return false;
+
+    case WIFI_CONNECTING:
+      break;
+  }
+
+  // Blink the LEDs while there is no time to display yet
+  if (timeStatus() == timeNotSet) {
+    SHIELD.setLEDColor((((millis() - wifiAttemptStart) / 250) & 1) ? green : black);
+  }
+
+  bool connected = (WiFi.status() == WL_CONNECTED);
+  if (!connected && ((millis() - wifiAttemptStart) < WIFI_ATTEMPT_TIMEOUT_MS)) {
+    return false;
   }
+  wifiConnectTime = millis() - wifiAttemptStart;
+  Serial.print("Connect time (ms): ");
+  Serial.println(wifiConnectTime);
+
+  if (!connected) {
+    WiFi.disconnect();
+    if (++wifiAttempt == WIFI_ATTEMPTS_PER_NETWORK) {
+      wifiAttempt = 0;
+      wifiCandidate++;
+    }
+    if (wifiCandidate < wifiCandidates) {
+      WIFI_BeginCandidate(wifiCandidate);
+      return false;
+    }
+  }
+  WIFI_Finish();
+  return true;
 }
 
 void WIFI_StartAccessPoint() {
   // Starts an access point with the specified name
   // and goes into a blocking loop awaiting configuration
   Serial.println("Starting Wifi AP");
+  if (WIFI_IsConnecting()) {
+    WIFI_Finish();
+  }
   WiFiManager wifiManager;
-  wifiManager.startConfigPortal(AP_NAME);
+  if (wifiManager.startConfigPortal(AP_NAME)) {
+    // Remember the network entered in the portal
+    WIFI_NETWORKS.add(WIFI_GetSSID().c_str(), WIFI_GetPassword().c_str());
+  }
+}
+
+// Decode hex text into bytes, ignoring whitespace. Returns the number
+// of bytes or -1 if the text is not valid hex or does not fit.
+int hexToBytes(const char* hex, uint8_t* out, int maxLen) {
+  int len = 0;
+  int nibbles = 0;
+  uint8_t value = 0;
+
+  for (; *hex; hex++) {
+    if (isspace(*hex)) {
+      continue;
+    }
+    if (!isxdigit(*hex)) {
+      return -1;
+    }
+    value = (value << 4) | (isdigit(*hex) ? *hex - '0' : (tolower(*hex) - 'a' + 10));
+    if (++nibbles == 2) {
+      if (len == maxLen) {
+        return -1;
+      }
+      out[len++] = value;
+      nibbles = 0;
+      value = 0;
+    }
+  }
+  return (nibbles == 0) ? len : -1;
+}
+
+// Load the stored user effect
+void EFFECT_Load() {
+  uint8_t code[EFFECT_MAX_SIZE];
+  Preferences prefs;
+
+  prefs.begin("effect", true);
+  size_t size = prefs.getBytes("code", code, sizeof(code));
+  prefs.end();
+
+  if (size > 0) {
+    const char* error = EFFECT.load(code, size);
+    if (error) {
+      Serial.print("Stored effect rejected: ");
+      Serial.println(error);
+    }
+  }
+}
+
+// POST /effect: validate and store a user effect sent as hex text.
+// A form encoded body is parsed into arguments and leaves "plain" empty.
+void HTTP_HandleEffectUpload() {
+  uint8_t code[EFFECT_MAX_SIZE];
+  int size = hexToBytes(WEBSERVER.arg("plain").c_str(), code, sizeof(code));
+  const char* error = (size < 0) ? "bad hex" : EFFECT.load(code, size);
+
+  if (error) {
+    WEBSERVER.send(400, "text/plain", error);
+    return;
+  }
+
+  Preferences prefs;
+  prefs.begin("effect", false);
+  prefs.putBytes("code", code, size);
+  prefs.end();
+
+  WEBSERVER.send(200, "text/plain", "OK");
+}
+
+// POST /effect/run: play the user effect
+void HTTP_HandleEffectRun() {
+  if (!EFFECT.isLoaded()) {
+    WEBSERVER.send(404, "text/plain", "no effect");
+  } else if (!clockOn) {
+    WEBSERVER.send(409, "text/plain", "clock is off");
+  } else {
+    EFFECT.start();
+    WEBSERVER.send(200, "text/plain", "OK");
+  }
+}
+
+// POST /effect/stop: stop the user effect
+void HTTP_HandleEffectStop() {
+  EFFECT.stop();
+  WEBSERVER.send(200, "text/plain", "OK");
+}
+
+// Animation file being uploaded
+File animationUploadFile;
+
+// POST /anim: store an uploaded animation file in LittleFS
+void HTTP_HandleAnimationUpload() {
+  HTTPUpload& upload = WEBSERVER.upload();
+
+  if (upload.status == UPLOAD_FILE_START) {
+    if ((upload.filename.length() == 0) || (upload.filename.indexOf('/') >= 0)) {
+      return;
+    }
+    LittleFS.mkdir(ANIMATION_DIR);
+    animationUploadFile = LittleFS.open(String(ANIMATION_DIR) + "/" + upload.filename, "w");
+  } else if (upload.status == UPLOAD_FILE_WRITE) {
+    // Written as it arrives, the file is never held in RAM
+    if (animationUploadFile) {
+      animationUploadFile.write(upload.buf, upload.currentSize);
+    }
+  } else if (upload.status == UPLOAD_FILE_END) {
+    if (animationUploadFile) {
+      animationUploadFile.close();
+    }
+  }
+}
+
+void HTTP_HandleAnimationUploadDone() {
+  WEBSERVER.send(200, "text/plain", "OK");
+}
+
+// POST /anim/stop: stop the animation
+void HTTP_HandleAnimationStop() {
+  ANIMATION.stop();
+  WEBSERVER.send(200, "text/plain", "OK");
+}
+
+// POST /anim/play?name=<file>: play an animation
+void HTTP_HandleAnimationPlay() {
+  if (!clockOn) {
+    WEBSERVER.send(409, "text/plain", "clock is off");
+  } else if (ANIMATION.play(WEBSERVER.arg("name").c_str())) {
+    WEBSERVER.send(200, "text/plain", "OK");
+  } else {
+    WEBSERVER.send(404, "text/plain", "no animation");
+  }
+}
+
+// POST /record/start and /record/stop: control input recording
+void HTTP_HandleRecordStart() {
+  if (RECORDER.start()) {
+    WEBSERVER.send(200, "text/plain", "OK");
+  } else {
+    WEBSERVER.send(500, "text/plain", "could not start recording");
+  }
+}
+
+void HTTP_HandleRecordStop() {
+  RECORDER.stop();
+  WEBSERVER.send(200, "text/plain", "OK");
+}
+
+// GET /record: download the last recording
+void HTTP_HandleRecordDownload() {
+  if (RECORDER.isRecording()) {
+    WEBSERVER.send(409, "text/plain", "recording in progress");
+    return;
+  }
+  File file = LittleFS.open(RECORDER_FILE, "r");
+  if (!file) {
+    WEBSERVER.send(404, "text/plain", "no recording");
+    return;
+  }
+  WEBSERVER.streamFile(file, "application/octet-stream");
+  file.close();
+}
+
+// Record WiFi events while recording inputs
+void WIFI_RecordEvent(WiFiEvent_t event) {
+  uint8_t id = event;
+  RECORDER.record(REC_WIFI, &id, sizeof(id));
+}
+
+// ***************************************************************
+// Maintenance jobs, deferred to the hours the clock is scheduled off
+// ***************************************************************
+
+// Measure the RTC error against NTP and set the RTC
+bool MAINT_CalibrateRTC(unsigned long& netMs) {
+  long errorMs, intervalSec;
+  unsigned long startTime = millis();
+  bool done = NTP::getInstance().calibrateRTC(errorMs, intervalSec);
+  netMs += millis() - startTime;
+
+  if (done) {
+    Serial.print("RTC error (ms) ");
+    Serial.print(errorMs);
+    Serial.print(" over (h) ");
+    Serial.print(intervalSec / 3600.0);
+    if (intervalSec > 0) {
+      Serial.print(", drift (ppm) ");
+      Serial.print(errorMs * 1e3 / intervalSec);
+    }
+    Serial.println();
+  }
+  return done;
+}
+
+// Save the tube-life counters
+bool MAINT_SaveCounters(unsigned long& netMs) {
+  OCCUPANCY.saveCounters();
+  return true;
+}
+
+// Install new firmware if it has been published
+bool MAINT_CheckFirmware(unsigned long& netMs) {
+  if (OTA.isRunning()) {
+    return false;
+  }
+  unsigned long startTime = millis();
+  bool available = OTA.isUpdateAvailable(OTA_SHA256_URL);
+  netMs += millis() - startTime;
+
+  if (available && OTA.start(OTA_FIRMWARE_URL, OTA_SHA256_URL)) {
+    Serial.println("Firmware update started");
+  }
+  return true;
+}
+
+// Commands queued by the JSON API, run from the main loop so requests
+// are answered without waiting for them
+#define API_QUEUE_SIZE 8
+char apiQueue[API_QUEUE_SIZE][TELEMETRY_COMMAND_SIZE];
+int apiQueueHead = 0;
+int apiQueueCount = 0;
+
+// Slowest API request so far
+unsigned long apiMaxTime = 0;
+
+bool API_Queue(const char* command) {
+  if (apiQueueCount == API_QUEUE_SIZE) {
+    return false;
+  }
+  strlcpy(apiQueue[(apiQueueHead + apiQueueCount) % API_QUEUE_SIZE], command, TELEMETRY_COMMAND_SIZE);
+  apiQueueCount++;
+  return true;
+}
+
+// Send a JSON response straight from a buffer
+void HTTP_SendJson(int code, const char* json, size_t len) {
+  WEBSERVER.setContentLength(len);
+  WEBSERVER.send(code, "application/json", "");
+  WEBSERVER.sendContent(json, len);
+}
+
+void HTTP_SendApiError(const char* error) {
+  char json[64];
+  int len = snprintf(json, sizeof(json), "{\"ok\":false,\"error\":\"%s\"}", error);
+  HTTP_SendJson(400, json, len);
+}
+
+// GET /api: settings and state
+void HTTP_HandleApiGet() {
+  unsigned long startTime = micros();
+  char json[768];
+  NTP& ntp = NTP::getInstance();
+
+  int len = snprintf(json, sizeof(json),
+                     "{\"fw\":\"%s\",\"serial\":\"%s\",\"time\":%ld,\"clock_on\":%s,"
+                     "\"sync\":\"%s\",\"last_sync\":%ld,\"effect\":%s,\"animation\":%s,"
+                     "\"settings\":{\"hour12\":%s,\"zeros\":%s,\"on_hour\":%d,\"off_hour\":%d,"
+                     "\"motion_hold\":%d,\"brightness\":%d,\"color\":%ld},\"api_max_us\":%lu,"
+                     "\"power_saves\":%lu,\"resume_ms\":%lu,\"maintenance\":[",
+                     FIRMWARE_VERSION, DISCOVERY.getSerial(), (long) now(), clockOn ? "true" : "false",
+                     ntp.getSyncSource(), (long) ntp.getLastSyncTime(),
+                     EFFECT.isRunning() ? "true" : "false", ANIMATION.isPlaying() ? "true" : "false",
+                     SETTINGS.hourFormat12 ? "true" : "false", SETTINGS.suppressLeadingZeros ? "true" : "false",
+                     SETTINGS.clockOnHour, SETTINGS.clockOffHour, SETTINGS.motionHoldMin,
+                     SETTINGS.ledBrightness, SETTINGS.ledColor, apiMaxTime,
+                     POWERFAIL.getSaveCount(), resumeTime);
+
+  // Figures of the last run of each maintenance job
+  for (int i = 0; (i < MAINTENANCE.getJobCount()) && (len < (int) sizeof(json)); i++) {
+    const Maintenance::Job& job = MAINTENANCE.getJob(i);
+    len += snprintf(json + len, sizeof(json) - len,
+                    "%s{\"job\":\"%s\",\"runs\":%lu,\"cpu_ms\":%lu,\"net_ms\":%lu}",
+                    (i > 0) ? "," : "", job.name, job.runs, job.cpuMs, job.netMs);
+  }
+  if (len < (int) sizeof(json)) {
+    len += snprintf(json + len, sizeof(json) - len, "]}");
+  }
+  HTTP_SendJson(200, json, min(len, (int) sizeof(json) - 1));
+
+  apiMaxTime = max(apiMaxTime, micros() - startTime);
+}
+
+// POST /api: {"set": {<name>: <value>, ...}, "action": <action>, "name": <name>}
+// Settings and the action are queued and applied from the main loop.
+void HTTP_HandleApiPost() {
+  unsigned long startTime = micros();
+  const String& body = WEBSERVER.arg("plain");
+  JsonTokenizer json(body.c_str(), body.length());
+
+  // Parsed request
+  char settings[API_QUEUE_SIZE][TELEMETRY_COMMAND_SIZE];
+  int settingCount = 0;
+  char action[16] = "";
+  char name[32] = "";
+
+  if (json.next().type != JSON_OBJECT_START) {
+    HTTP_SendApiError("expected an object");
+    return;
+  }
+
+  for (JsonToken key = json.next(); key.type == JSON_KEY; key = json.next()) {
+    if (key.equals("set")) {
+      if (json.next().type != JSON_OBJECT_START) {
+        HTTP_SendApiError("set must be an object");
+        return;
+      }
+      for (JsonToken setting = json.next(); setting.type == JSON_KEY; setting = json.next()) {
+        char settingName[16];
+        JsonToken value = json.next();
+        if (value.type == JSON_ERROR) {
+          HTTP_SendApiError(json.error());
+          return;
+        }
+        if ((value.type != JSON_NUMBER) && (value.type != JSON_TRUE) && (value.type != JSON_FALSE)) {
+          HTTP_SendApiError("setting values must be numbers or booleans");
+          return;
+        }
+        if (settingCount == API_QUEUE_SIZE) {
+          HTTP_SendApiError("too many settings");
+          return;
+        }
+        setting.copyTo(settingName, sizeof(settingName));
+        if (!Settings::isValid(settingName, value.number)) {
+          HTTP_SendApiError("unknown setting or value out of range");
+          return;
+        }
+        snprintf(settings[settingCount++], TELEMETRY_COMMAND_SIZE, "set %s %ld", settingName, value.number);
+      }
+    } else if (key.equals("action") || key.equals("name")) {
+      JsonToken value = json.next();
+      if (value.type != JSON_STRING) {
+        HTTP_SendApiError("action and name must be strings");
+        return;
+      }
+      if (key.equals("action")) {
+        value.copyTo(action, sizeof(action));
+      } else {
+        value.copyTo(name, sizeof(name));
+      }
+    } else if (!json.skipValue()) {
+      break;
+    }
+  }
+  if (json.next().type != JSON_END) {
+    HTTP_SendApiError(json.error() ? json.error() : "malformed JSON");
+    return;
+  }
+
+  // Build the action command
+  char command[TELEMETRY_COMMAND_SIZE] = "";
+  if (strcmp(action, "play") == 0) {
+    if ((name[0] == 0) || strchr(name, ' ')) {
+      HTTP_SendApiError("play needs a name");
+      return;
+    }
+    snprintf(command, sizeof(command), "play %s", name);
+  } else if ((strcmp(action, "sync") == 0) || (strcmp(action, "antipoison") == 0) ||
+             (strcmp(action, "effect") == 0) || (strcmp(action, "stop") == 0) ||
+             (strcmp(action, "update") == 0) ||
+             (strcmp(action, "restart") == 0)) {
+    strlcpy(command, action, sizeof(command));
+  } else if (action[0] != 0) {
+    HTTP_SendApiError("unknown action");
+    return;
+  }
+
+  if (apiQueueCount + settingCount + (command[0] ? 1 : 0) > API_QUEUE_SIZE) {
+    HTTP_SendApiError("busy");
+    return;
+  }
+  for (int i = 0; i < settingCount; i++) {
+    API_Queue(settings[i]);
+  }
+  if (command[0]) {
+    API_Queue(command);
+  }
+
+  char response[32];
+  int len = snprintf(response, sizeof(response), "{\"ok\":true,\"queued\":%d}",
+                     settingCount + (command[0] ? 1 : 0));
+  HTTP_SendJson(200, response, len);
+
+  apiMaxTime = max(apiMaxTime, micros() - startTime);
 }
 
 // ***************************************************************
@@ -429,7 +1232,9 @@ void setup() {
 
   // Configure serial interface
   Serial.begin(115200);
-  delay(1000);
+  if (!PowerFail::hasSavedState()) {
+    delay(1000);
+  }
   Serial.println();
 
   pinMode(SS, OUTPUT);
@@ -439,36 +1244,110 @@ void setup() {
   SPI.setDataMode (SPI_MODE2);  // Mode 2 SPI
   SPI.setClockDivider(2000000); // SCK = 2MHz
 
+  // Load settings, the configuration items above are the defaults
+  SETTINGS.begin(HOUR_FORMAT_12, SUPPRESS_LEADING_ZEROS,
+                 CLOCK_ON_HOUR, CLOCK_OFF_HOUR, MOTION_HOLD_MIN, LED_BRIGHTNESS);
+  SHIELD.setLEDBrightness(SETTINGS.ledBrightness);
+
+  // Enable frequency scaling and light sleep
+  POWER.begin(PM_MAX_FREQ_MHZ, PM_MIN_FREQ_MHZ, PM_LIGHT_SLEEP);
+
+  // Start watching for motion
+  OCCUPANCY.begin(MOTION_SENSOR_PIN, SETTINGS.motionHoldMin * 60UL);
+  OCCUPANCY.loadCounters();
+
+  // Resume the display right away after a supply failure, then arm the
+  // state save for the next one
+  displayResumed = RESUME_Display();
+  POWERFAIL.begin(HV_ENABLE, SUPPLY_SENSE_PIN, SUPPLY_SENSE_RATIO, SUPPLY_FAIL_MV);
+
   // Reset saved settings for testing purposes
   // Should be commented out for normal operation
   // wifiManager.resetSettings();
 
   WiFi.mode(WIFI_AP_STA);
+  WiFi.onEvent(WIFI_RecordEvent);
+
+  // Prefer the NTP servers announced by DHCP (option 42)
+  NTP::requestDHCPServers();
   Serial.println(WIFI_GetSSID());
   Serial.println(WIFI_GetPassword());
 
+  // Load the known networks
+  WIFI_NETWORKS.begin(WIFI_GetSSID(), WIFI_GetPassword());
+
   // If WiFi setup is not configured, start access point
   // Otherwise, connect to WiFi
-  if (0 == WIFI_GetSSID().length()) {
+  if (0 == WIFI_NETWORKS.count()) {
     WIFI_StartAccessPoint();
   } else {
+    // Wait for the first connection, the first NTP sync needs it
     WIFI_Connect();
+    while (!WIFI_Poll()) {
+      if (displayResumed) {
+        RESUME_Wait(10);
+      } else {
+        delay(10);
+      }
+    }
   }
   delay(100);
 
   initNTP(SHIELD);
 
-  // Set all LEDs to black or off
-  SHIELD.setLEDColor(black);
+  // Telemetry connects in the background once WiFi is up
+  TELEMETRY.begin(MQTT_HOST, MQTT_PORT, DISCOVERY.getSerial());
+  if (displayResumed) {
+    TELEMETRY.event("power_resume");
+  }
 
-  // Turn off the dots
-  SHIELD.dotsEnable(false);
+  // Mount the file system holding the animations
+  if (!LittleFS.begin(true)) {
+    Serial.println("LittleFS mount failed");
+  }
+
+  // Load the user effect and start serving the endpoints
+  EFFECT_Load();
+  WEBSERVER.on("/effect", HTTP_POST, HTTP_HandleEffectUpload);
+  WEBSERVER.on("/effect/run", HTTP_POST, HTTP_HandleEffectRun);
+  WEBSERVER.on("/effect/stop", HTTP_POST, HTTP_HandleEffectStop);
+  WEBSERVER.on("/anim", HTTP_POST, HTTP_HandleAnimationUploadDone, HTTP_HandleAnimationUpload);
+  WEBSERVER.on("/anim/play", HTTP_POST, HTTP_HandleAnimationPlay);
+  WEBSERVER.on("/anim/stop", HTTP_POST, HTTP_HandleAnimationStop);
+  WEBSERVER.on("/api", HTTP_GET, HTTP_HandleApiGet);
+  WEBSERVER.on("/api", HTTP_POST, HTTP_HandleApiPost);
+  WEBSERVER.on("/record", HTTP_GET, HTTP_HandleRecordDownload);
+  WEBSERVER.on("/record/start", HTTP_POST, HTTP_HandleRecordStart);
+  WEBSERVER.on("/record/stop", HTTP_POST, HTTP_HandleRecordStop);
+  WEBSERVER.begin();
+  DISCOVERY.advertise(HTTP_PORT, FIRMWARE_VERSION);
+
+  // Jobs run while the clock is scheduled off
+  MAINTENANCE.add("rtc_cal", MAINT_CalibrateRTC, true);
+  MAINTENANCE.add("counters", MAINT_SaveCounters, false);
+#if OTA_NIGHTLY_CHECK
+  MAINTENANCE.add("ota_check", MAINT_CheckFirmware, true);
+#endif
+
+  // The display is already running after a fast resume
+  if (!displayResumed) {
+    // Set all LEDs to black or off
+    SHIELD.setLEDColor(black);
+
+    // Turn off the dots
+    SHIELD.dotsEnable(false);
+
+    // Turn on the high voltage for the clock
+    SHIELD.hvEnable(true);
 
-  // Turn on the high voltage for the clock
-  SHIELD.hvEnable(true);
+    // Do the anti poisoning routine
+    SHIELD.doAntiPoisoning();
+  }
+  // Later reconnects blink the LEDs as before
+  displayResumed = false;
 
-  // Do the anti poisoning routine
-  SHIELD.doAntiPoisoning();
+  // Reaching this point means a freshly installed image works
+  OTA.confirmBoot();
 
   Serial.println("\nReady!\n");
 }
@@ -478,19 +1357,82 @@ void setup() {
 // ***************************************************************
 
 unsigned long nextConnectionCheckTime = 0;
+unsigned long nextPowerReportTime = PM_REPORT_INTERVAL_MS;
+unsigned long nextTelemetryTime = MQTT_TELEMETRY_INTERVAL_SEC * 1000UL;
+unsigned long previousSyncCount = 0;
+unsigned long previousMotionCount = 0;
+char command[TELEMETRY_COMMAND_SIZE];
 int previousSecond = 0;
 
 void loop() {
-  // Check WiFi connectivity
-  if (millis() > nextConnectionCheckTime) {
-    Serial.print("\n\nChecking WiFi... ");
-    if (WiFi.status() != WL_CONNECTED) {
-      Serial.println("WiFi connection lost. Reconnecting...");
-      WIFI_Connect();
-    } else {
-      Serial.println("Wifi connected");
+  // Check WiFi connectivity. Connecting runs alongside the display.
+  if (WIFI_Poll()) {
+    // Attempt finished, check again later
+    nextConnectionCheckTime = millis() + ((WiFi.status() == WL_CONNECTED) ? WIFI_CHK_TIME_MS : WIFI_RETRY_TIME_MS);
+  } else if (!WIFI_IsConnecting()) {
+    if (millis() > nextConnectionCheckTime) {
+      Serial.print("\n\nChecking WiFi... ");
+      if (WiFi.status() != WL_CONNECTED) {
+        Serial.println("WiFi connection lost. Reconnecting...");
+        WIFI_Connect();
+      } else {
+        Serial.println("Wifi connected");
+        nextConnectionCheckTime = millis() + WIFI_CHK_TIME_MS;
+      }
+    } else if ((WiFi.status() != WL_CONNECTED) && (nextConnectionCheckTime - millis() > WIFI_RETRY_TIME_MS)) {
+      // Connection dropped, retry sooner than the regular check
+      nextConnectionCheckTime = millis() + WIFI_RETRY_TIME_MS;
+    }
+  }
+
+  // Report power and display latency figures
+  if (millis() > nextPowerReportTime) {
+    POWER.printReport();
+    nextPowerReportTime = millis() + PM_REPORT_INTERVAL_MS;
+  }
+
+  // Turn the high voltage back on after a supply sag that did not reset.
+  // The level is set while the pin is still held low.
+  if (POWERFAIL.takeRecovered()) {
+    Serial.println("Supply recovered");
+    SHIELD.hvEnable(clockOn);
+    SHIELD.hvAttach();
+  }
+
+  // Serve HTTP requests
+  WEBSERVER.handleClient();
+
+  // Send telemetry and handle remote commands
+  TELEMETRY.loop();
+  if (OCCUPANCY.getMotionCount() != previousMotionCount) {
+    previousMotionCount = OCCUPANCY.getMotionCount();
+    uint8_t motionCount = previousMotionCount;
+    RECORDER.record(REC_MOTION, &motionCount, sizeof(motionCount));
+  }
+  RECORDER.loop();
+  FAULTS.loop();
+  if (TELEMETRY.takeCommand(command, sizeof(command))) {
+    processCommand(command);
+  }
+  if (apiQueueCount > 0) {
+    processCommand(apiQueue[apiQueueHead]);
+    apiQueueHead = (apiQueueHead + 1) % API_QUEUE_SIZE;
+    apiQueueCount--;
+  }
+  if (millis() > nextTelemetryTime) {
+    publishTelemetry();
+    nextTelemetryTime = millis() + MQTT_TELEMETRY_INTERVAL_SEC * 1000UL;
+  }
+
+  // Run deferred maintenance while the clock is scheduled off
+  if (timeStatus() != timeNotSet) {
+    bool window = !clockScheduledOn && !EFFECT.isRunning() && !ANIMATION.isPlaying();
+    const Maintenance::Job* job = MAINTENANCE.loop(window, WiFi.status() == WL_CONNECTED);
+    if (job) {
+      char event[24];
+      snprintf(event, sizeof(event), "maint_%s", job->name);
+      TELEMETRY.event(event);
     }
-    nextConnectionCheckTime = millis() + WIFI_CHK_TIME_MS;
   }
 
   // Process button status
@@ -506,14 +1448,57 @@ void loop() {
     esp_restart();
   }
 
+  // If up button is long-pressed, start a firmware update
+  if (SHIELD.isUpButtonLongClicked()) {
+    if (OTA.start(OTA_FIRMWARE_URL, OTA_SHA256_URL)) {
+      Serial.println("Firmware update started");
+    }
+  }
+
   // Update the display only if time has changed
   if (timeStatus() != timeNotSet) {
     if (second() != previousSecond) {
       previousSecond = second();
+      POWER.secondEdge();
+      POWERFAIL.update(now());
+      RECORDER.recordSecond(now());
+
+      // Display updated once a second. Effects and animations keep the
+      // tubes, but the clock still turns off.
+      bool timeShown = updateDisplay();
+      POWER.secondHandled();
+      if (timeShown) {
+        FAULTS.secondShown(now());
+      } else {
+        FAULTS.secondSkipped(now());
+      }
 
-      // Display updated once a second
+      OCCUPANCY.accountSecond(clockOn, clockScheduledOn);
+      DISCOVERY.update(NTP::getInstance().getSyncSource());
+
+      // Report time syncs as telemetry events
+      if (NTP::getInstance().getSyncCount() != previousSyncCount) {
+        previousSyncCount = NTP::getInstance().getSyncCount();
+        char event[16];
+        snprintf(event, sizeof(event), "sync_%s", NTP::getInstance().getSyncSource());
+        TELEMETRY.event(event);
+      }
+    } else if (OCCUPANCY.takeMotionEvent() && !clockOn && clockScheduledOn) {
+      // Wake up right away on motion rather than at the next second
       updateDisplay();
     }
+
+    // Advance the high voltage fade and blank the tubes once it is done
+    if (SHIELD.isFading()) {
+      SHIELD.hvFadeTick();
+      if (!SHIELD.isFading() && !clockOn) {
+        blankDisplay();
+      }
+    }
+
+    // Advance the user effect and animation
+    EFFECT.tick(TZ.toLocal(now()));
+    ANIMATION.tick();
   }
   delay(10);
 }
@@ -0,0 +1,333 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    EffectVM.h - Bytecode interpreter for user-defined display effects
+
+    Effects are small programs that set digits, dots and LED colors, wait,
+    loop and read the time. A program is validated once when it is loaded,
+    so the interpreter does no checking while running. It allocates nothing
+    and runs a bounded number of instructions per tick. There are no jumps
+    other than counted loops, so every program terminates. Nested loops can
+    still make a program run for a very long time, so a run is stopped after
+    EFFECT_MAX_RUN_MS.
+
+    Instruction set (opcode followed by operand bytes):
+
+      00                 END     Stop the effect
+      01 t d             DIGIT   Set tube t (0 = NX1 .. 5 = NX6) to digit d (0-9, 10 = blank)
+      02 t r s           DIGITR  Set tube t to digit s (0 = ones, 1 = tens, 2 = hundreds) of register r
+      03 b               DOTS    Dots off (0) or on (1)
+      04 r g b           COLOR   Set LED color
+      05 r               WHEEL   Set LED color from the color wheel at register r
+      06 lo hi           WAIT    Show the tubes and wait lo + hi * 256 ms
+      07 n               LOOP    Repeat the block up to the matching NEXT n times (1-255)
+      08                 NEXT    End of loop block
+      09 r f             TIME    Load time field f into register r
+                                 (0 hour, 1 hour 12h, 2 minute, 3 second, 4 day, 5 month, 6 year)
+      0A r v             LOAD    Load register r with v (0-255)
+      0B r v             ADD     Add v (-128..127) to register r
+      0C                 SHOW    Show the tubes
+*/
+
+#ifndef EFFECT_VM_H
+#define EFFECT_VM_H
+
+#include "NixieTubeShield.h"
+
+#define EFFECT_MAX_SIZE        512 // Maximum program size in bytes
+#define EFFECT_REGISTERS         4
+#define EFFECT_LOOP_DEPTH        4
+#define EFFECT_STEPS_PER_TICK   64 // Instructions executed per call to tick()
+#define EFFECT_MAX_RUN_MS   600000 // Longest run before the effect is stopped
+
+#define EFFECT_OP_END     0x00
+#define EFFECT_OP_DIGIT   0x01
+#define EFFECT_OP_DIGITR  0x02
+#define EFFECT_OP_DOTS    0x03
+#define EFFECT_OP_COLOR   0x04
+#define EFFECT_OP_WHEEL   0x05
+#define EFFECT_OP_WAIT    0x06
+#define EFFECT_OP_LOOP    0x07
+#define EFFECT_OP_NEXT    0x08
+#define EFFECT_OP_TIME    0x09
+#define EFFECT_OP_LOAD    0x0A
+#define EFFECT_OP_ADD     0x0B
+#define EFFECT_OP_SHOW    0x0C
+#define EFFECT_OP_COUNT   0x0D
+
+// Instruction lengths including the opcode
+const uint8_t EFFECT_OP_LENGTH[EFFECT_OP_COUNT] = {
+  1, 3, 4, 2, 4, 2, 3, 2, 1, 3, 3, 3, 1
+};
+
+// EffectVM Class Definition
+class EffectVM {
+  public:
+    EffectVM(NixieTubeShield& shield) : _shield(shield) {
+    }
+
+    // Check and load a program. Returns NULL on success or a description
+    // of the problem.
+    const char* load(const uint8_t* code, size_t size) {
+      const char* error = validate(code, size);
+      if (error) {
+        return error;
+      }
+      stop();
+      memcpy(_code, code, size);
+      _size = size;
+      return NULL;
+    }
+
+    bool isLoaded() {
+      return _size > 0;
+    }
+
+    bool isRunning() {
+      return _running;
+    }
+
+    // Start the loaded program from the beginning
+    void start() {
+      if (_size == 0) {
+        return;
+      }
+      _pc = 0;
+      _loopDepth = 0;
+      _startTime = millis();
+      _waitUntil = _startTime;
+      _steps = 0;
+      _runUs = 0;
+      _outputUs = 0;
+      memset(_regs, 0, sizeof(_regs));
+      _running = true;
+    }
+
+    void stop() {
+      if (_running) {
+        _running = false;
+        printStats();
+      }
+    }
+
+    // Run the program until it waits, ends or uses up its step budget
+    void tick(time_t localTime) {
+      if (!_running) {
+        return;
+      }
+      if ((millis() - _startTime) > EFFECT_MAX_RUN_MS) {
+        Serial.println("Effect ran too long");
+        stop();
+        return;
+      }
+      if ((long) (millis() - _waitUntil) < 0) {
+        return;
+      }
+
+      unsigned long startUs = micros();
+      int steps = 0;
+
+      while (_running && (steps < EFFECT_STEPS_PER_TICK)) {
+        const uint8_t* op = &_code[_pc];
+        _pc += EFFECT_OP_LENGTH[op[0]];
+        steps++;
+
+        switch (op[0]) {
+          case EFFECT_OP_END:
+            _running = false;
+            break;
+
+          case EFFECT_OP_DIGIT:
+            _shield.setTubeDigit(op[1], op[2]);
+            break;
+
+          case EFFECT_OP_DIGITR: {
+            int value = abs(_regs[op[2]]);
+            for (int i = 0; i < op[3]; i++) {
+              value /= 10;
+            }
+            _shield.setTubeDigit(op[1], value % 10);
+            break;
+          }
+
+          case EFFECT_OP_DOTS:
+            _shield.dotsEnable(op[1]);
+            break;
+
+          case EFFECT_OP_COLOR: {
+            unsigned long outputUs = micros();
+            _shield.setLEDColor(op[1], op[2], op[3]);
+            _outputUs += micros() - outputUs;
+            break;
+          }
+
+          case EFFECT_OP_WHEEL: {
+            unsigned long outputUs = micros();
+            _shield.setLEDColor(_shield.colorWheel(abs(_regs[op[1]])));
+            _outputUs += micros() - outputUs;
+            break;
+          }
+
+          case EFFECT_OP_WAIT: {
+            unsigned long outputUs = micros();
+            _shield.show();
+            _outputUs += micros() - outputUs;
+            _waitUntil = millis() + op[1] + (op[2] << 8);
+            finishTick(startUs, steps);
+            return;
+          }
+
+          case EFFECT_OP_LOOP:
+            _loops[_loopDepth].start = _pc;
+            _loops[_loopDepth].remaining = op[1];
+            _loopDepth++;
+            break;
+
+          case EFFECT_OP_NEXT:
+            if (--_loops[_loopDepth - 1].remaining > 0) {
+              _pc = _loops[_loopDepth - 1].start;
+            } else {
+              _loopDepth--;
+            }
+            break;
+
+          case EFFECT_OP_TIME:
+            _regs[op[1]] = timeField(localTime, op[2]);
+            break;
+
+          case EFFECT_OP_LOAD:
+            _regs[op[1]] = op[2];
+            break;
+
+          case EFFECT_OP_ADD:
+            _regs[op[1]] += (int8_t) op[2];
+            break;
+
+          case EFFECT_OP_SHOW: {
+            unsigned long outputUs = micros();
+            _shield.show();
+            _outputUs += micros() - outputUs;
+            break;
+          }
+        }
+      }
+      finishTick(startUs, steps);
+    }
+
+    // Print instruction count and dispatch throughput of the last run.
+    // Time spent showing frames and writing the LEDs is left out of the
+    // throughput and printed separately.
+    void printStats() {
+      unsigned long dispatchUs = (_runUs > _outputUs) ? _runUs - _outputUs : 0;
+
+      Serial.print("Effect: ");
+      Serial.print(_steps);
+      Serial.print(" instructions, ");
+      Serial.print(dispatchUs ? (float) _steps / dispatchUs : 0);
+      Serial.print(" M instructions/s, output (us) ");
+      Serial.println(_outputUs);
+    }
+
+  private:
+    void finishTick(unsigned long startUs, int steps) {
+      _runUs += micros() - startUs;
+      _steps += steps;
+      if (!_running) {
+        // Ended by END
+        printStats();
+      }
+    }
+
+    // Check opcodes, operand ranges and loop nesting
+    static const char* validate(const uint8_t* code, size_t size) {
+      size_t pc = 0;
+      int depth = 0;
+      uint8_t lastOp = EFFECT_OP_END;
+
+      if ((size == 0) || (size > EFFECT_MAX_SIZE)) {
+        return "bad size";
+      }
+
+      while (pc < size) {
+        const uint8_t* op = &code[pc];
+        if (op[0] >= EFFECT_OP_COUNT) {
+          return "bad opcode";
+        }
+        if (pc + EFFECT_OP_LENGTH[op[0]] > size) {
+          return "truncated instruction";
+        }
+
+        switch (op[0]) {
+          case EFFECT_OP_DIGIT:
+            if ((op[1] > 5) || (op[2] > BLANK_DIGIT)) return "bad digit";
+            break;
+          case EFFECT_OP_DIGITR:
+            if ((op[1] > 5) || (op[2] >= EFFECT_REGISTERS) || (op[3] > 2)) return "bad digit";
+            break;
+          case EFFECT_OP_WHEEL:
+          case EFFECT_OP_LOAD:
+          case EFFECT_OP_ADD:
+            if (op[1] >= EFFECT_REGISTERS) return "bad register";
+            break;
+          case EFFECT_OP_TIME:
+            if ((op[1] >= EFFECT_REGISTERS) || (op[2] > 6)) return "bad time field";
+            break;
+          case EFFECT_OP_LOOP:
+            if (op[1] == 0) return "bad loop count";
+            if (++depth > EFFECT_LOOP_DEPTH) return "loops nested too deep";
+            break;
+          case EFFECT_OP_NEXT:
+            if (--depth < 0) return "NEXT without LOOP";
+            break;
+        }
+        lastOp = op[0];
+        pc += EFFECT_OP_LENGTH[op[0]];
+      }
+
+      if (depth != 0) {
+        return "LOOP without NEXT";
+      }
+      if (lastOp != EFFECT_OP_END) {
+        return "missing END";
+      }
+      return NULL;
+    }
+
+    static int timeField(time_t t, int field) {
+      switch (field) {
+        case 0:  return hour(t);
+        case 1:  return hourFormat12(t);
+        case 2:  return minute(t);
+        case 3:  return second(t);
+        case 4:  return day(t);
+        case 5:  return month(t);
+        default: return year(t) % 100;
+      }
+    }
+
+    // Instance of shield
+    NixieTubeShield& _shield;
+
+    // Program storage
+    uint8_t _code[EFFECT_MAX_SIZE];
+    size_t _size = 0;
+
+    // Execution state
+    bool _running = false;
+    size_t _pc = 0;
+    int16_t _regs[EFFECT_REGISTERS];
+    struct {
+      size_t start;
+      uint8_t remaining;
+    } _loops[EFFECT_LOOP_DEPTH];
+    int _loopDepth = 0;
+    unsigned long _startTime = 0;
+    unsigned long _waitUntil = 0;
+
+    // Statistics for the current run
+    unsigned long _steps = 0;
+    unsigned long _runUs = 0;     // Time in tick(), including output
+    unsigned long _outputUs = 0;  // Time showing frames and writing LEDs
+};
+
+#endif
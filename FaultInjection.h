@@ -0,0 +1,188 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    FaultInjection.h - Scripted hardware and network fault injection
+
+    When built with FAULT_INJECTION defined, a scenario can be started that
+    makes the I2C bus NACK or stall, corrupts SPI frames, drops WiFi, and
+    delays or loses NTP responses for a while. A scenario starts on the next
+    second boundary. During the scenario and until the clock recovers, every
+    frame that shows the time is checked against a reference clock taken at
+    that boundary:
+
+      missing   no frame was shown for that second
+      wrong     the frame showed another second, or was corrupted
+
+    Seconds in which the clock is off, or an effect, animation or the date
+    is shown, are skipped.
+
+    Time to recover is measured from the end of the scenario to the first
+    correct frame. Without FAULT_INJECTION no faults are ever injected.
+*/
+
+#ifndef FAULT_INJECTION_H
+#define FAULT_INJECTION_H
+
+#define FAULT_I2C_NACK     0x01
+#define FAULT_I2C_STALL    0x02
+#define FAULT_SPI_CORRUPT  0x04
+#define FAULT_WIFI_DROP    0x08
+#define FAULT_UDP_DELAY    0x10
+#define FAULT_UDP_LOSS     0x20
+
+#define FAULT_I2C_STALL_MS  500  // Bus stall before the NACK
+#define FAULT_UDP_DELAY_MS  800  // Added delay before NTP responses are read
+#define FAULT_SPI_RATE       4   // One in this many frames is corrupted
+
+// FaultInjector Class Definition
+class FaultInjector {
+  public:
+    struct Scenario {
+      const char* name;
+      uint8_t faults;
+      unsigned int durationSec;
+    };
+
+    // Start a scenario by name. Returns false if it is unknown or fault
+    // injection is not built in.
+    bool start(const char* name) {
+#ifdef FAULT_INJECTION
+      static const Scenario scenarios[] = {
+        { "i2c_nack",    FAULT_I2C_NACK,                  60 },
+        { "i2c_stall",   FAULT_I2C_STALL,                 60 },
+        { "spi_corrupt", FAULT_SPI_CORRUPT,               30 },
+        { "wifi_drop",   FAULT_WIFI_DROP,                120 },
+        { "udp_delay",   FAULT_UDP_DELAY,                120 },
+        { "udp_loss",    FAULT_UDP_LOSS,                 120 },
+        { "no_time",     FAULT_I2C_NACK | FAULT_UDP_LOSS, 120 },
+      };
+
+      for (unsigned int i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (strcmp(name, scenarios[i].name) == 0) {
+          _scenario = scenarios[i];
+          _faults = 0;
+          _measuring = false;
+          _refTime = now();
+          _pending = true;
+
+          Serial.print("Fault scenario starts at the next second: ");
+          Serial.println(name);
+          return true;
+        }
+      }
+#endif
+      return false;
+    }
+
+    // True if the fault is being injected right now
+    bool active(uint8_t fault) {
+#ifdef FAULT_INJECTION
+      return (_faults & fault) != 0;
+#else
+      return false;
+#endif
+    }
+
+    // Called by show(). Returns true if this frame should be corrupted.
+    bool corruptFrame() {
+      if (!active(FAULT_SPI_CORRUPT) || (random(FAULT_SPI_RATE) != 0)) {
+        return false;
+      }
+      _corrupted = true;
+      return true;
+    }
+
+    // Called from the main loop before the display is updated. Starts the
+    // scenario on a second boundary, ends it and drops WiFi once.
+    void loop() {
+      if (_pending && (now() != _refTime)) {
+        _pending = false;
+        _faults = _scenario.faults;
+        _startTime = millis();
+        _endTime = _startTime + _scenario.durationSec * 1000UL;
+        _refTime = now();
+        _lastShown = _refTime;
+        _missing = 0;
+        _wrong = 0;
+        _measuring = true;
+        _wifiDropped = false;
+        Serial.println("Fault scenario started");
+      }
+      if (_faults == 0) {
+        return;
+      }
+      if (active(FAULT_WIFI_DROP) && !_wifiDropped) {
+        _wifiDropped = true;
+        WiFi.disconnect();
+      }
+      if ((long) (millis() - _endTime) >= 0) {
+        _faults = 0;
+        Serial.println("Fault scenario ended");
+      }
+    }
+
+    // Called instead of secondShown() for a second that deliberately did
+    // not show the time
+    void secondSkipped(time_t t) {
+      if (_measuring) {
+        _lastShown = t;
+      }
+    }
+
+    // Called after a frame showing the time has been latched
+    void secondShown(time_t shown) {
+      if (!_measuring) {
+        return;
+      }
+
+      // Frames follow the reference boundary by the loop latency at most
+      time_t expected = _refTime + (millis() - _startTime + 500) / 1000;
+      bool wrong = _corrupted || (shown != expected);
+      _corrupted = false;
+
+      // Seconds skipped since the last frame
+      if (shown > _lastShown + 1) {
+        _missing += shown - _lastShown - 1;
+      }
+      _lastShown = shown;
+
+      if (wrong) {
+        _wrong++;
+      } else if (_faults == 0) {
+        // First correct frame after the scenario ended
+        _measuring = false;
+        printReport(millis() - _endTime);
+      }
+    }
+
+  private:
+    void printReport(unsigned long recoveryMs) {
+      Serial.print("Fault scenario ");
+      Serial.print(_scenario.name);
+      Serial.print(": recovery (ms) ");
+      Serial.print(recoveryMs);
+      Serial.print(", missing (s) ");
+      Serial.print(_missing);
+      Serial.print(", wrong (s) ");
+      Serial.println(_wrong);
+    }
+
+    Scenario _scenario = { "", 0, 0 };
+    volatile uint8_t _faults = 0;
+    bool _pending = false;   // Waiting for the second boundary to start
+    bool _measuring = false;
+    bool _wifiDropped = false;
+    bool _corrupted = false;
+
+    unsigned long _startTime = 0;
+    unsigned long _endTime = 0;
+    time_t _refTime = 0;
+    time_t _lastShown = 0;
+
+    unsigned long _missing = 0;
+    unsigned long _wrong = 0;
+};
+
+FaultInjector FAULTS;
+
+#endif
@@ -0,0 +1,157 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    InputRecorder.h - Records non-deterministic inputs for offline analysis
+
+    While recording, the clock's local inputs are appended to /record.bin in
+    LittleFS: button clicks, NTP responses, RTC reads, WiFi events, PIR motion
+    and second timer fires. Remote MQTT and HTTP commands, the setting changes
+    they make, WiFi scan results and DHCP supplied NTP servers are not
+    recorded. The file starts with the magic "NXR1" followed by records of
+
+      type (1 byte)      one of the REC_* values below
+      delta (varint)     microseconds since the previous record, 7 bits per
+                         byte, least significant first
+      payload            fixed size for the type
+
+    Records are collected in a small RAM buffer and flushed to the file from
+    the main loop. tools/dump_recording.py decodes a recording.
+*/
+
+#ifndef INPUT_RECORDER_H
+#define INPUT_RECORDER_H
+
+#include <LittleFS.h>
+
+#define RECORDER_FILE        "/record.bin"
+#define RECORDER_MAGIC       "NXR1"
+#define RECORDER_BUFFER_SIZE 1024
+#define RECORDER_MAX_RECORD  64
+
+#define REC_BUTTON  1  // button (0 set, 1 up, 2 down), clicks (int8)
+#define REC_NTP     2  // 48 byte NTP response
+#define REC_RTC     3  // second, minute, hour, weekday, day, month, year
+#define REC_WIFI    4  // WiFi event id
+#define REC_SECOND  5  // time_t of the second being displayed (4 bytes, little endian)
+#define REC_MOTION  6  // motion bursts seen so far (1 byte, wraps)
+
+// InputRecorder Class Definition
+class InputRecorder {
+  public:
+    bool isRecording() {
+      return _recording;
+    }
+
+    // Start a new recording, replacing the previous one
+    bool start() {
+      if (_recording) {
+        return true;
+      }
+      _file = LittleFS.open(RECORDER_FILE, "w");
+      if (!_file) {
+        Serial.println("Recorder: could not create file");
+        return false;
+      }
+      _file.write((const uint8_t*) RECORDER_MAGIC, 4);
+      _length = 0;
+      _dropped = 0;
+      _records = 0;
+      _lastUs = esp_timer_get_time();
+      _recording = true;
+      Serial.println("Recording inputs");
+      return true;
+    }
+
+    void stop() {
+      if (!_recording) {
+        return;
+      }
+      _recording = false;
+      flush();
+      _file.close();
+
+      Serial.print("Recorder: ");
+      Serial.print(_records);
+      Serial.print(" records, ");
+      Serial.print(_dropped);
+      Serial.println(" dropped");
+    }
+
+    // Append a record. May be called from the WiFi event task.
+    void record(uint8_t type, const void* payload, size_t size) {
+      if (!_recording) {
+        return;
+      }
+      uint8_t header[6];
+      int headerSize = 0;
+
+      portENTER_CRITICAL(&_mux);
+      int64_t nowUs = esp_timer_get_time();
+      uint32_t delta = nowUs - _lastUs;
+
+      header[headerSize++] = type;
+      do {
+        header[headerSize++] = (delta & 0x7F) | ((delta > 0x7F) ? 0x80 : 0);
+        delta >>= 7;
+      } while (delta);
+
+      if (_length + headerSize + size <= sizeof(_buffer)) {
+        memcpy(&_buffer[_length], header, headerSize);
+        memcpy(&_buffer[_length + headerSize], payload, size);
+        _length += headerSize + size;
+        _lastUs = nowUs;
+        _records++;
+      } else {
+        _dropped++;
+      }
+      portEXIT_CRITICAL(&_mux);
+    }
+
+    void recordButton(uint8_t button, int clicks) {
+      uint8_t payload[2] = { button, (uint8_t) (int8_t) clicks };
+      record(REC_BUTTON, payload, sizeof(payload));
+    }
+
+    void recordSecond(time_t t) {
+      uint32_t value = t;
+      uint8_t payload[4] = { (uint8_t) value, (uint8_t) (value >> 8),
+                             (uint8_t) (value >> 16), (uint8_t) (value >> 24) };
+      record(REC_SECOND, payload, sizeof(payload));
+    }
+
+    // Called from the main loop. Writes the buffer out before it fills up.
+    void loop() {
+      if (_recording && (_length > sizeof(_buffer) - RECORDER_MAX_RECORD * 4)) {
+        flush();
+      }
+    }
+
+  private:
+    void flush() {
+      uint8_t copy[RECORDER_BUFFER_SIZE];
+      size_t length;
+
+      portENTER_CRITICAL(&_mux);
+      length = _length;
+      memcpy(copy, _buffer, length);
+      _length = 0;
+      portEXIT_CRITICAL(&_mux);
+
+      _file.write(copy, length);
+    }
+
+    volatile bool _recording = false;
+    File _file;
+
+    portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+    uint8_t _buffer[RECORDER_BUFFER_SIZE];
+    size_t _length = 0;
+    int64_t _lastUs = 0;
+
+    unsigned long _records = 0;
+    unsigned long _dropped = 0;
+};
+
+InputRecorder RECORDER;
+
+#endif
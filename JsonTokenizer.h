@@ -0,0 +1,251 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    JsonTokenizer.h - Allocation-free JSON tokenizer
+
+    Returns one token at a time from a JSON text. Strings are returned as a
+    pointer into the input and a length, without unescaping, so nothing is
+    copied or allocated. Numbers must be integers that fit a long; fractions,
+    exponents and larger numbers are errors. Separators (':' and ',') are
+    checked and skipped.
+*/
+
+#ifndef JSON_TOKENIZER_H
+#define JSON_TOKENIZER_H
+
+#include <limits.h>
+
+#define JSON_MAX_DEPTH 8
+
+enum JsonTokenType {
+  JSON_END,          // End of input
+  JSON_ERROR,        // Malformed input
+  JSON_OBJECT_START,
+  JSON_OBJECT_END,
+  JSON_ARRAY_START,
+  JSON_ARRAY_END,
+  JSON_KEY,          // Object member name
+  JSON_STRING,
+  JSON_NUMBER,
+  JSON_TRUE,
+  JSON_FALSE,
+  JSON_NULL
+};
+
+struct JsonToken {
+  JsonTokenType type;
+  const char* str;  // JSON_KEY and JSON_STRING, not terminated
+  int len;
+  long number;      // JSON_NUMBER, JSON_TRUE (1) and JSON_FALSE (0)
+
+  // Compare a key or string token with a C string
+  bool equals(const char* s) const {
+    return (strncmp(str, s, len) == 0) && (s[len] == 0);
+  }
+
+  // Copy a key or string token into a buffer, truncating if needed
+  void copyTo(char* buffer, size_t size) const {
+    size_t n = min((size_t) len, size - 1);
+    memcpy(buffer, str, n);
+    buffer[n] = 0;
+  }
+};
+
+// JsonTokenizer Class Definition
+class JsonTokenizer {
+  public:
+    JsonTokenizer(const char* json, size_t len) : _p(json), _end(json + len) {
+    }
+
+    JsonToken next() {
+      JsonToken token = { JSON_ERROR, NULL, 0, 0 };
+
+      if (_error) {
+        return token;
+      }
+      skipSpace();
+
+      // Separators between values and between keys and values
+      if (_depth > 0) {
+        bool inObject = _inObject[_depth - 1];
+        if ((_p < _end) && (*_p == ',') && _needComma) {
+          _p++;
+          _needComma = false;
+          skipSpace();
+          if ((_p < _end) && ((*_p == '}') || (*_p == ']'))) {
+            return fail();
+          }
+        }
+        if (inObject && _expectValue) {
+          if ((_p >= _end) || (*_p != ':')) {
+            return fail();
+          }
+          _p++;
+          skipSpace();
+        }
+      }
+
+      if (_p >= _end) {
+        token.type = (_depth == 0) ? JSON_END : JSON_ERROR;
+        return token;
+      }
+
+      char c = *_p;
+      bool closing = (c == '}') || (c == ']');
+      if (_needComma && !closing) {
+        return fail();
+      }
+
+      bool keyExpected = (_depth > 0) && _inObject[_depth - 1] && !_expectValue && !closing;
+
+      switch (c) {
+        case '{':
+        case '[':
+          if (_depth == JSON_MAX_DEPTH) {
+            return fail();
+          }
+          _inObject[_depth++] = (c == '{');
+          _p++;
+          _expectValue = false;
+          _needComma = false;
+          token.type = (c == '{') ? JSON_OBJECT_START : JSON_ARRAY_START;
+          return token;
+
+        case '}':
+        case ']':
+          if ((_depth == 0) || (_inObject[_depth - 1] != (c == '}')) || _expectValue) {
+            return fail();
+          }
+          _depth--;
+          _p++;
+          valueDone();
+          token.type = (c == '}') ? JSON_OBJECT_END : JSON_ARRAY_END;
+          return token;
+
+        case '"': {
+          const char* start = ++_p;
+          while ((_p < _end) && (*_p != '"')) {
+            if (*_p == '\\') {
+              _p++;
+            }
+            _p++;
+          }
+          if (_p >= _end) {
+            return fail();
+          }
+          token.str = start;
+          token.len = _p - start;
+          _p++;
+          if (keyExpected) {
+            _expectValue = true;
+            token.type = JSON_KEY;
+          } else {
+            valueDone();
+            token.type = JSON_STRING;
+          }
+          return token;
+        }
+      }
+
+      if (keyExpected) {
+        return fail();
+      }
+
+      if ((c == '-') || isdigit(c)) {
+        bool negative = (c == '-');
+        if (negative) {
+          _p++;
+        }
+        if ((_p >= _end) || !isdigit(*_p)) {
+          return fail();
+        }
+        long value = 0;
+        while ((_p < _end) && isdigit(*_p)) {
+          int digit = *_p++ - '0';
+          if (value > (LONG_MAX - digit) / 10) {
+            return fail("number out of range");
+          }
+          value = value * 10 + digit;
+        }
+        if ((_p < _end) && ((*_p == '.') || (*_p == 'e') || (*_p == 'E'))) {
+          return fail("numbers must be integers");
+        }
+        token.number = negative ? -value : value;
+        token.type = JSON_NUMBER;
+      } else if (match("true")) {
+        token.number = 1;
+        token.type = JSON_TRUE;
+      } else if (match("false")) {
+        token.type = JSON_FALSE;
+      } else if (match("null")) {
+        token.type = JSON_NULL;
+      } else {
+        return fail();
+      }
+      valueDone();
+      return token;
+    }
+
+    // Description of the first error, or NULL
+    const char* error() {
+      return _errorText;
+    }
+
+    // Skip the value that follows a key, including nested objects and arrays
+    bool skipValue() {
+      int depth = 0;
+      do {
+        JsonToken token = next();
+        if ((token.type == JSON_ERROR) || (token.type == JSON_END)) {
+          return false;
+        }
+        if ((token.type == JSON_OBJECT_START) || (token.type == JSON_ARRAY_START)) {
+          depth++;
+        } else if ((token.type == JSON_OBJECT_END) || (token.type == JSON_ARRAY_END)) {
+          depth--;
+        }
+      } while (depth > 0);
+      return true;
+    }
+
+  private:
+    void skipSpace() {
+      while ((_p < _end) && isspace(*_p)) {
+        _p++;
+      }
+    }
+
+    bool match(const char* word) {
+      size_t len = strlen(word);
+      if (((size_t) (_end - _p) >= len) && (strncmp(_p, word, len) == 0)) {
+        _p += len;
+        return true;
+      }
+      return false;
+    }
+
+    void valueDone() {
+      _expectValue = false;
+      _needComma = (_depth > 0);
+    }
+
+    JsonToken fail(const char* error = "malformed JSON") {
+      JsonToken token = { JSON_ERROR, NULL, 0, 0 };
+      _error = true;
+      _errorText = error;
+      return token;
+    }
+
+    const char* _p;
+    const char* _end;
+    bool _error = false;
+    const char* _errorText = NULL;
+
+    // Nesting state
+    bool _inObject[JSON_MAX_DEPTH];
+    int _depth = 0;
+    bool _expectValue = false;  // A key was read, its value comes next
+    bool _needComma = false;    // A value was read, a comma or close comes next
+};
+
+#endif
@@ -87,8 +87,17 @@ class LEDControl {
       return color;
     }
 
+    // Scale all LED colors, 255 is full brightness
+    void setLEDBrightness(byte value) {
+      brightness = value;
+    }
+
     // Set the RGB LEDs color
     void setLEDColor(byte red, byte green, byte blue) {
+      red   = (red   * brightness) / 255;
+      green = (green * brightness) / 255;
+      blue  = (blue  * brightness) / 255;
+
       red   = gammaArray[red];
       green = gammaArray[green];
       blue  = gammaArray[blue];
@@ -112,6 +121,7 @@ class LEDControl {
   private:
     // Private data
     int redPin, greenPin, bluePin;
+    byte brightness = 255;
 
     // Gamma correction array
     const byte gammaArray [256] = {
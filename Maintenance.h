@@ -0,0 +1,125 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    Maintenance.h - Maintenance jobs run while the clock is off
+
+    Heavy background jobs are deferred to the hours the clock is scheduled
+    off, so they never compete with the display. Each job runs at most once
+    per MAINTENANCE_INTERVAL_HOURS, one job per call to loop(). A local job
+    that has been waiting longer than MAINTENANCE_MAX_DEFER_HOURS runs
+    anyway, so a clock that is never scheduled off still gets it. Jobs that
+    need the network can block for seconds, which would freeze the tubes,
+    so they only ever run while the clock is scheduled off.
+
+    Each job reports how long it spent waiting on the network. The rest of
+    its run time is reported as CPU time.
+*/
+
+#ifndef MAINTENANCE_H
+#define MAINTENANCE_H
+
+#define MAINTENANCE_MAX_JOBS         6
+#define MAINTENANCE_INTERVAL_HOURS  20  // Once a night
+#define MAINTENANCE_MAX_DEFER_HOURS 48
+#define MAINTENANCE_RETRY_MIN       10  // Wait after a job could not run
+
+// A job returns false if it could not run and should be retried.
+// It adds the time spent waiting on the network to netMs.
+typedef bool (*MaintenanceJobFunc)(unsigned long& netMs);
+
+// Maintenance Class Definition
+class Maintenance {
+  public:
+    struct Job {
+      const char* name;
+      MaintenanceJobFunc run;
+      bool needsNetwork;
+      unsigned long lastRunMs;   // Last successful run
+      unsigned long nextTryMs;   // No retry before this time
+      bool hasRun;
+      unsigned long cpuMs;       // Figures of the last run
+      unsigned long netMs;
+      unsigned long runs;
+    };
+
+    void add(const char* name, MaintenanceJobFunc run, bool needsNetwork) {
+      if (_jobCount == MAINTENANCE_MAX_JOBS) {
+        return;
+      }
+      Job& job = _jobs[_jobCount++];
+      job.name = name;
+      job.run = run;
+      job.needsNetwork = needsNetwork;
+      job.lastRunMs = millis();
+      job.nextTryMs = millis();
+      job.hasRun = false;
+      job.cpuMs = 0;
+      job.netMs = 0;
+      job.runs = 0;
+    }
+
+    // Called from the main loop. Runs the next job that is due, if any.
+    // Returns the job that ran, or NULL.
+    const Job* loop(bool inWindow, bool online) {
+      unsigned long nowMs = millis();
+
+      for (int i = 0; i < _jobCount; i++) {
+        Job& job = _jobs[(_next + i) % _jobCount];
+        unsigned long waitingMs = nowMs - job.lastRunMs;
+
+        bool due = !job.hasRun || (waitingMs >= MAINTENANCE_INTERVAL_HOURS * 3600000UL);
+        bool overdue = (waitingMs >= MAINTENANCE_MAX_DEFER_HOURS * 3600000UL) &&
+                       !job.needsNetwork;
+        if (!due || (!inWindow && !overdue) || ((long) (nowMs - job.nextTryMs) < 0) ||
+            (job.needsNetwork && !online)) {
+          continue;
+        }
+        _next = (_next + i + 1) % _jobCount;
+
+        unsigned long netMs = 0;
+        unsigned long startTime = millis();
+        bool done = job.run(netMs);
+        unsigned long elapsed = millis() - startTime;
+
+        if (!done) {
+          job.nextTryMs = millis() + MAINTENANCE_RETRY_MIN * 60000UL;
+          Serial.print("Maintenance ");
+          Serial.print(job.name);
+          Serial.println(" could not run, will retry");
+          return NULL;
+        }
+        job.lastRunMs = millis();
+        job.hasRun = true;
+        job.netMs = min(netMs, elapsed);
+        job.cpuMs = elapsed - job.netMs;
+        job.runs++;
+
+        Serial.print("Maintenance ");
+        Serial.print(job.name);
+        Serial.print(overdue && !inWindow ? " (overdue)" : "");
+        Serial.print(": CPU (ms) ");
+        Serial.print(job.cpuMs);
+        Serial.print(", network (ms) ");
+        Serial.println(job.netMs);
+        return &job;
+      }
+      return NULL;
+    }
+
+    int getJobCount() {
+      return _jobCount;
+    }
+
+    const Job& getJob(int i) {
+      return _jobs[i];
+    }
+
+  private:
+    Job _jobs[MAINTENANCE_MAX_JOBS];
+    int _jobCount = 0;
+    int _next = 0;  // Jobs take turns
+};
+
+Maintenance MAINTENANCE;
+
+#endif
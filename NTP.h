@@ -2,6 +2,15 @@
     ESP32 NTP Nixie Tube Clock Program
 
     NTP.h - Network Time Protocol Functions
+
+    NTP servers handed out by DHCP (option 42) are tried first. The public
+    servers are a fallback, tried in order of their measured round trip time.
+
+    The RTC is set on every sync. It starts counting a second when it is
+    written, so it runs behind by the part of the NTP second that had passed.
+    That lag is remembered, and calibrateRTC() compares the RTC with NTP at
+    the start of an RTC second. The drift since the last write is then
+    measured to within the NTP round trip, not to whole seconds.
 */
 
 #ifndef NTP_H
@@ -9,14 +18,18 @@
 
 #include <TimeLib.h>
 #include <WiFiUdp.h>
+#include <lwip/apps/sntp.h>
+#include "FaultInjection.h"
 
 // Define the time between sync events
 #define SYNC_INTERVAL_HOURS   1
 #define SYNC_INTERVAL_MINUTES (SYNC_INTERVAL_HOURS   * 60L)
 #define SYNC_INTERVAL_SECONDS (SYNC_INTERVAL_MINUTES * 60L)
 
-#define NTP_SERVER_NAME "time.nist.gov" // NTP request server
+#define NTP_SERVER_NAMES { "time.nist.gov", "pool.ntp.org", "time.google.com" } // Fallback servers
 #define NTP_SERVER_PORT  123 // NTP requests are to port 123
+#define NTP_TIMEOUT_MS  1000 // Time to wait for a response
+#define NTP_MAX_SERVERS    6 // DHCP provided plus fallback servers
 #define LOCALPORT       2390 // Local port to listen for UDP packets
 #define NTP_PACKET_SIZE   48 // NTP time stamp is in the first 48 bytes of the message
 #define RETRIES           20 // Times to try getting NTP time before failing
@@ -26,8 +39,24 @@ class NTP {
     NTP(NixieTubeShield& shield) : _shield(shield) {
       // Login succeeded so set UDP local port
       udp.begin(LOCALPORT);
+
+      // Start with the fallback servers, DHCP provided ones are added before each sync
+      const char* names[] = NTP_SERVER_NAMES;
+      for (unsigned int i = 0; (i < sizeof(names) / sizeof(names[0])) && (_serverCount < NTP_MAX_SERVERS); i++) {
+        addServer(names[i], false);
+      }
     };
 
+    // Ask lwIP to keep the NTP servers from the DHCP lease.
+    // Must be called before WiFi connects.
+    static void requestDHCPServers() {
+#if SNTP_GET_SERVERS_FROM_DHCP
+      sntp_servermode_dhcp(1);
+#else
+      Serial.println("Warning! lwIP built without SNTP_GET_SERVERS_FROM_DHCP, DHCP NTP servers are ignored");
+#endif
+    }
+
     static NTP& getInstance() {
       return *_instance;
     }
@@ -40,30 +69,233 @@ class NTP {
     // Get NTP time with retries on access failure
     time_t getTime() {
       unsigned long result;
-    
+
+      netPMLock.acquire();
+      refreshDHCPServers();
+      rankServers();
       for (int i = 0; i < RETRIES; i++) {
-        result = _getTime();
+        result = _getTime(_servers[_order[i % _serverCount]]);
         if (result != 0) {
-          // Update RTC
-          tmElements_t tm;
-          breakTime(result, tm);
-          _shield.setRTCDateTime(tm);
+          setRTC(result, _secondStartMs);
+          netPMLock.release();
+          _lastSyncTime = result;
+          _syncCount++;
+          _syncSource = "ntp";
+          printServers();
           return result;
         }
         Serial.println("Problem getting NTP time. Retrying...");
         delay(300);
       }
+      netPMLock.release();
       Serial.println("NTP Problem - Could not obtain time. Falling back to RTC");
-    
-      return _getRTCTime();
+
+      result = _getRTCTime();
+      _syncCount++;
+      _syncSource = (result != 0) ? "rtc" : "none";
+      return result;
+    }
+
+    // Time of the last successful NTP sync, 0 if never synced
+    time_t getLastSyncTime() {
+      return _lastSyncTime;
+    }
+
+    // Number of sync attempts so far
+    unsigned long getSyncCount() {
+      return _syncCount;
+    }
+
+    // Source of the last time sync: "ntp", "rtc" or "none"
+    const char* getSyncSource() {
+      return _syncSource;
+    }
+
+    // Query every server once, refreshing their round trip times, then
+    // measure the RTC against the answer of the best ranked server and set
+    // it. errorMs is the error the RTC built up over intervalSec since it
+    // was last set; intervalSec is 0 if it has not been set since boot.
+    // Returns false if the RTC or every server failed to answer.
+    bool calibrateRTC(long& errorMs, long& intervalSec) {
+      time_t result = 0;
+      unsigned long resultStartMs = 0;
+
+      netPMLock.acquire();
+      refreshDHCPServers();
+      rankServers();
+      for (int i = 0; i < _serverCount; i++) {
+        time_t t = _getTime(_servers[_order[i]]);
+        if ((t != 0) && (result == 0)) {
+          result = t;
+          resultStartMs = _secondStartMs;
+        }
+      }
+      rankServers();
+      netPMLock.release();
+
+      time_t rtcTime;
+      unsigned long edgeMs;
+      if ((result == 0) || !findRTCEdge(rtcTime, edgeMs)) {
+        return false;
+      }
+
+      // RTC time minus NTP time at the start of the RTC second. Just after
+      // it was set, the RTC was behind by _rtcLagMs.
+      int64_t nowErrorMs = ((int64_t) rtcTime - (int64_t) result) * 1000 -
+                           (long) (edgeMs - resultStartMs);
+      if (_rtcSetTime != 0) {
+        errorMs = nowErrorMs + _rtcLagMs;
+        intervalSec = (long) (rtcTime - _rtcSetTime);
+      } else {
+        errorMs = nowErrorMs;
+        intervalSec = 0;
+      }
+      setRTC(result, resultStartMs);
+      return true;
+    }
+
+    // Print the servers with their round trip time and jitter
+    void printServers() {
+      for (int i = 0; i < _serverCount; i++) {
+        NTPServer& server = _servers[_order[i]];
+        Serial.print("NTP server ");
+        Serial.print(server.name);
+        Serial.print(server.local ? " (DHCP)" : "");
+        Serial.print(": RTT (ms) ");
+        Serial.print(server.rtt);
+        Serial.print(", jitter (ms) ");
+        Serial.println(server.jitter);
+      }
     }
   
   private:
+    struct NTPServer {
+      char name[40];  // Host name or IP address
+      bool local;     // Provided by DHCP
+      int rtt;        // Smoothed round trip time in ms, -1 until measured
+      int jitter;     // Smoothed round trip time deviation in ms
+    };
+
     // Static NTP instance
     static NTP* _instance;
+
+    // Set the RTC from an NTP result. secondStartMs is the millis() value at
+    // which second t began. Writing the seconds register restarts the
+    // DS1307's one second countdown, so the RTC runs behind by the part of
+    // the current second that has already passed.
+    void setRTC(time_t t, unsigned long secondStartMs) {
+      tmElements_t tm;
+      unsigned long elapsedMs = millis() - secondStartMs;
+      time_t s = t + elapsedMs / 1000;
+
+      breakTime(s, tm);
+      _shield.setRTCDateTime(tm);
+      _rtcSetTime = s;
+      _rtcLagMs = elapsedMs % 1000;
+    }
+
+    // Wait for the RTC to start a new second. Returns false if it did not
+    // answer or did not tick.
+    bool findRTCEdge(time_t& t, unsigned long& edgeMs) {
+      tmElements_t m;
+      if (!_shield.getRTCTime(m, false)) {
+        return false;
+      }
+
+      byte prevSeconds = m.Second;
+      unsigned long startTime = millis();
+      while (prevSeconds == m.Second) {
+        if ((millis() - startTime) > 1500) {
+          return false;
+        }
+        _shield.getRTCTime(m, false);
+      }
+      edgeMs = millis();
+      _shield.recordRTCTime(m);
+      t = makeTime(m);
+      return true;
+    }
+
+    void addServer(const char* name, bool local) {
+      NTPServer& server = _servers[_serverCount++];
+      strlcpy(server.name, name, sizeof(server.name));
+      server.local = local;
+      server.rtt = -1;
+      server.jitter = 0;
+    }
+
+    // Put the NTP servers from the DHCP lease in front of the fallback servers
+    void refreshDHCPServers() {
+      char name[40];
+      int first = 0;
+
+      // Skip the DHCP servers of the previous lease
+      while ((first < _serverCount) && _servers[first].local) {
+        first++;
+      }
+      int dhcpCount = 0;
+      NTPServer dhcp[SNTP_MAX_SERVERS];
+
+      for (int i = 0; i < SNTP_MAX_SERVERS; i++) {
+        const ip_addr_t* addr = sntp_getserver(i);
+        if ((addr == NULL) || ip_addr_isany(addr)) {
+          continue;
+        }
+        ipaddr_ntoa_r(addr, name, sizeof(name));
+
+        // Keep the measurements of a server we already know
+        NTPServer& server = dhcp[dhcpCount++];
+        strlcpy(server.name, name, sizeof(server.name));
+        server.local = true;
+        server.rtt = -1;
+        server.jitter = 0;
+        for (int j = 0; j < first; j++) {
+          if (strcmp(_servers[j].name, name) == 0) {
+            server = _servers[j];
+          }
+        }
+      }
+
+      // Rebuild the list with the DHCP servers first
+      int fallbackCount = _serverCount - first;
+      dhcpCount = min(dhcpCount, NTP_MAX_SERVERS - fallbackCount);
+      memmove(&_servers[dhcpCount], &_servers[first], fallbackCount * sizeof(NTPServer));
+      memcpy(_servers, dhcp, dhcpCount * sizeof(NTPServer));
+      _serverCount = dhcpCount + fallbackCount;
+    }
+
+    // Order the servers: DHCP provided first, then by round trip time.
+    // Servers not measured yet rank between slow and failed ones.
+    void rankServers() {
+      for (int i = 0; i < _serverCount; i++) {
+        _order[i] = i;
+      }
+      for (int i = 1; i < _serverCount; i++) {
+        for (int j = i; (j > 0) && (rank(_order[j]) < rank(_order[j - 1])); j--) {
+          int t = _order[j];
+          _order[j] = _order[j - 1];
+          _order[j - 1] = t;
+        }
+      }
+    }
+
+    long rank(int i) {
+      long rtt = (_servers[i].rtt < 0) ? NTP_TIMEOUT_MS / 2 : _servers[i].rtt;
+      return rtt + (_servers[i].local ? 0 : NTP_TIMEOUT_MS * 2);
+    }
+
+    // Fold a round trip time sample into the server's statistics
+    void updateRTT(NTPServer& server, int sample) {
+      if (server.rtt < 0) {
+        server.rtt = sample;
+        return;
+      }
+      server.jitter += (abs(sample - server.rtt) - server.jitter) / 4;
+      server.rtt += (sample - server.rtt) / 4;
+    }
   
     // NTP Time Provider Code
-    time_t _getTime() {
+    time_t _getTime(NTPServer& server) {
       // Set all bytes in the buffer to 0
       memset(packetBuffer, 0, NTP_PACKET_SIZE);
     
@@ -76,17 +308,42 @@ class NTP {
       packetBuffer[14] = 0x31;
       packetBuffer[15] = 0x34;
     
+      // Drop any late responses to earlier requests
+      while (udp.parsePacket() > 0) {
+        udp.flush();
+      }
+
       // All NTP fields initialized, now send a packet requesting a timestamp
-      udp.beginPacket(NTP_SERVER_NAME, NTP_SERVER_PORT);
+      if (!udp.beginPacket(server.name, NTP_SERVER_PORT)) {
+        updateRTT(server, NTP_TIMEOUT_MS);
+        return 0;
+      }
       udp.write(packetBuffer, NTP_PACKET_SIZE);
       udp.endPacket();
-    
-      // Wait a second for the response
-      delay(1000);
-    
+      unsigned long sentTime = millis();
+
+      // Wait up to a second for the response
+      int size = 0;
+      while ((size != NTP_PACKET_SIZE) && ((millis() - sentTime) < NTP_TIMEOUT_MS)) {
+        delay(1);
+        size = udp.parsePacket();
+      }
+
+      // Injected network faults
+      if ((size == NTP_PACKET_SIZE) && FAULTS.active(FAULT_UDP_LOSS)) {
+        udp.flush();
+        size = 0;
+      } else if ((size == NTP_PACKET_SIZE) && FAULTS.active(FAULT_UDP_DELAY)) {
+        delay(FAULT_UDP_DELAY_MS);
+      }
+
       // Listen for the response
-      if (udp.parsePacket() == NTP_PACKET_SIZE) {
+      if (size == NTP_PACKET_SIZE) {
+        unsigned long receivedTime = millis();
+        int rtt = receivedTime - sentTime;
+        updateRTT(server, rtt);
         udp.read(packetBuffer, NTP_PACKET_SIZE);  // Read packet into the buffer
+        RECORDER.record(REC_NTP, packetBuffer, NTP_PACKET_SIZE);
         unsigned long secsSince1900;
     
         // Convert four bytes starting at location 40 to a long integer
@@ -94,11 +351,19 @@ class NTP {
         secsSince1900 |= (unsigned long) packetBuffer[41] << 16;
         secsSince1900 |= (unsigned long) packetBuffer[42] << 8;
         secsSince1900 |= (unsigned long) packetBuffer[43];
+
+        // The transmit timestamp's fraction and about half the round trip
+        // have passed since the second began
+        uint32_t fraction = ((uint32_t) packetBuffer[44] << 24) | ((uint32_t) packetBuffer[45] << 16) |
+                            ((uint32_t) packetBuffer[46] << 8) | packetBuffer[47];
+        _secondStartMs = receivedTime - rtt / 2 - (unsigned long) (((uint64_t) fraction * 1000) >> 32);
     
-        Serial.println("Got NTP time");
+        Serial.print("Got NTP time from ");
+        Serial.println(server.name);
     
         return secsSince1900 - 2208988800UL;
       } else  {
+        updateRTT(server, NTP_TIMEOUT_MS);
         return 0;
       }
     }
@@ -107,7 +372,10 @@ class NTP {
     time_t _getRTCTime() {
       bool isRTCAvailable = true;
       tmElements_t m;
-      _shield.getRTCTime(m);
+      if (!_shield.getRTCTime(m, false)) {
+        Serial.println("Warning! RTC did not respond!");
+        return 0;
+      }
     
       byte prevSeconds = m.Second;
       unsigned long RTC_ReadingStartTime = millis();
@@ -120,7 +388,9 @@ class NTP {
       Serial.println(m.Second);
     
       while (prevSeconds == m.Second) {
-        _shield.getRTCTime(m);
+        // A failed read leaves m unchanged until the timeout.
+        // Only the read that is used gets recorded.
+        _shield.getRTCTime(m, false);
         if ((millis() - RTC_ReadingStartTime) > 3000) {
           Serial.println("Warning! RTC did not respond!");
           isRTCAvailable = false;
@@ -131,6 +401,7 @@ class NTP {
       // Set system time if RTC is available
       if (isRTCAvailable) {
         Serial.println("Got time from RTC");
+        _shield.recordRTCTime(m);
         return makeTime(m);
       } else {
         return 0;
@@ -145,12 +416,31 @@ class NTP {
 
     // Buffer to hold outgoing and incoming packets
     byte packetBuffer[NTP_PACKET_SIZE];
+
+    // Servers, DHCP provided ones first, and the order to try them in
+    NTPServer _servers[NTP_MAX_SERVERS];
+    int _order[NTP_MAX_SERVERS];
+    int _serverCount = 0;
+
+    // Sync state
+    time_t _lastSyncTime = 0;
+    unsigned long _syncCount = 0;
+    const char* _syncSource = "none";
+    unsigned long _secondStartMs = 0;  // millis() when the last NTP result's second began
+    time_t _rtcSetTime = 0;            // When the RTC was last set, 0 if not since boot
+    int _rtcLagMs = 0;                 // How far the RTC was behind just after that
 };
 
 NTP* NTP::_instance = 0;
 
 time_t getNTPTime() {
-  return NTP::getInstance().getTime();
+  time_t t = NTP::getInstance().getTime();
+
+  // TimeLib sets the time as soon as this returns
+  if (t != 0) {
+    POWER.timeSet();
+  }
+  return t;
 }
 
 // Initialize the NTP code
@@ -165,4 +455,10 @@ void initNTP(NixieTubeShield& shield) {
   setSyncInterval(SYNC_INTERVAL_SECONDS);
 }
 
+// Sync time from NTP right away
+void forceNTPSync() {
+  // Setting the provider again makes the next call to now() sync
+  setSyncProvider(getNTPTime);
+}
+
 #endif
@@ -9,7 +9,10 @@
 
 #include <ClickButton.h>
 #include <Wire.h>
+#include "FaultInjection.h"
+#include "InputRecorder.h"
 #include "LEDControl.h"
+#include "PowerManagement.h"
 #include "Tone.h"
 
 // ***************************************************************
@@ -29,6 +32,14 @@
 
 #define DS1307_ADDRESS 0x68
 
+// High voltage is driven through a PWM channel so the tubes can be faded.
+// Channels share a timer in pairs (0/1, 2/3, ...), so the pair 6/7 is kept
+// clear of the LED and tone channels.
+#define HV_CHANNEL      6
+#define HV_PWM_FREQ  1000
+#define HV_PWM_BITS     8
+#define HV_DUTY_MAX   255
+
 // ***************************************************************
 // Digit Data Definitions
 // Each digit, except blank, has a single active low bit in a
@@ -66,6 +77,8 @@ class NixieTubeShield : public LEDControl {
 
       // Setup output pins
       pinMode(HV_ENABLE,    OUTPUT);
+      ledcSetup(HV_CHANNEL, HV_PWM_FREQ, HV_PWM_BITS);
+      ledcAttachPin(HV_ENABLE, HV_CHANNEL);
       pinMode(LATCH_ENABLE, OUTPUT);
       pinMode(NEON_DOTS,    OUTPUT);
       pinMode(MODE_BUTTON,  INPUT_PULLUP);
@@ -74,7 +87,7 @@ class NixieTubeShield : public LEDControl {
       //pinMode(NEON_DOTS_LOWER,    OUTPUT);
 
       // Set default outputs
-      digitalWrite(HV_ENABLE,    LOW);
+      ledcWrite(HV_CHANNEL, 0);
       digitalWrite(LATCH_ENABLE, LOW);
       digitalWrite(NEON_DOTS,    LOW);
 
@@ -96,9 +109,64 @@ class NixieTubeShield : public LEDControl {
       }
     }
 
-    // High voltage control
+    // High voltage control. Cancels a fade in progress.
     void hvEnable(boolean state) {
-      digitalWrite(HV_ENABLE, state ? HIGH : LOW);
+      if (_fading) {
+        _fading = false;
+        ledcPMLock.release();
+      }
+
+      // Keep the APB clock up while the PWM outputs are lit
+      if (state && (hvLevel == 0)) {
+        ledcPMLock.acquire();
+      } else if (!state && (hvLevel > 0)) {
+        ledcPMLock.release();
+      }
+      hvLevel = state ? HV_DUTY_MAX : 0;
+      ledcWrite(HV_CHANNEL, hvLevel);
+    }
+
+    // Give the high voltage enable pin back to the PWM after it was forced
+    // low on a supply failure (see PowerFail.h)
+    void hvAttach() {
+      ledcAttachPin(HV_ENABLE, HV_CHANNEL);
+    }
+
+    // Start ramping the high voltage on or off over the given time.
+    // The ramp is advanced by hvFadeTick() from the main loop.
+    void hvFade(boolean state, int durationMs) {
+      if (_fading) {
+        _fadeFrom = _fadeDuty;
+      } else {
+        ledcPMLock.acquire();
+        _fadeFrom = hvLevel;
+        _fading = true;
+      }
+      _fadeState = state;
+      _fadeStartTime = millis();
+      _fadeMs = max(durationMs, 1);
+      _fadeDuty = _fadeFrom;
+    }
+
+    bool isFading() {
+      return _fading;
+    }
+
+    // Step a fade started by hvFade()
+    void hvFadeTick() {
+      if (!_fading) {
+        return;
+      }
+      unsigned long elapsed = millis() - _fadeStartTime;
+      if (elapsed >= _fadeMs) {
+        _fading = false;
+        hvEnable(_fadeState);
+        ledcPMLock.release();
+        return;
+      }
+      int target = _fadeState ? HV_DUTY_MAX : 0;
+      _fadeDuty = _fadeFrom + ((target - _fadeFrom) * (long) elapsed) / (long) _fadeMs;
+      ledcWrite(HV_CHANNEL, _fadeDuty);
     }
 
     // Neon lamp control
@@ -137,7 +205,13 @@ class NixieTubeShield : public LEDControl {
       digits[0] = NUMERIC_DIGITS[d];
     }
 
+    // Set a digit by tube position, 0 is NX1 (most significant)
+    void setTubeDigit(int tube, int d) {
+      digits[5 - tube] = NUMERIC_DIGITS[d];
+    }
+
     void show() {
+      spiPMLock.acquire();
       digitalWrite(LATCH_ENABLE, LOW);    // allow data input (Transparent mode)
       unsigned long Var32=0;
        
@@ -174,12 +248,18 @@ class NixieTubeShield : public LEDControl {
       if (dotsEnabled) Var32|=UpperDotsMask;
       else Var32&=~UpperDotsMask;  
 
+      // Flip a random bit when injecting SPI faults
+      if (FAULTS.corruptFrame()) Var32^=1UL<<random(32);
+
       SPI.transfer(Var32>>24);
       SPI.transfer(Var32>>16);
       SPI.transfer(Var32>>8);
       SPI.transfer(Var32);
     
       digitalWrite(LATCH_ENABLE, HIGH);     // latching data 
+      spiPMLock.release();
+
+      POWER.frameShown();
     }
 
     // Do anti-poisoning routine and then turn off all tubes
@@ -213,6 +293,10 @@ class NixieTubeShield : public LEDControl {
         setButton.Update();
         upButton.Update();
         downButton.Update();
+
+        if (setButton.clicks != 0) RECORDER.recordButton(0, setButton.clicks);
+        if (upButton.clicks != 0) RECORDER.recordButton(1, upButton.clicks);
+        if (downButton.clicks != 0) RECORDER.recordButton(2, downButton.clicks);
     }
 
     bool isSetButtonClicked() {
@@ -239,12 +323,27 @@ class NixieTubeShield : public LEDControl {
       return (downButton.clicks < 0);
     }
 
-    void getRTCTime(tmElements_t &m) {
+    // Read the RTC. Returns false, leaving m unchanged, if the RTC did not answer.
+    // Pass record = false when polling, and record the read that is used with
+    // recordRTCTime(), so the recorder buffer is not flooded.
+    bool getRTCTime(tmElements_t &m, bool record = true) {
+      if (FAULTS.active(FAULT_I2C_STALL)) {
+        delay(FAULT_I2C_STALL_MS);
+        return false;
+      }
+      if (FAULTS.active(FAULT_I2C_NACK)) {
+        return false;
+      }
+
       Wire.beginTransmission(DS1307_ADDRESS);
       Wire.write(zero);
-      Wire.endTransmission();
+      if (Wire.endTransmission() != 0) {
+        return false;
+      }
     
-      Wire.requestFrom(DS1307_ADDRESS, 7);
+      if (Wire.requestFrom(DS1307_ADDRESS, 7) != 7) {
+        return false;
+      }
 
       m.Second = bcdToDec(Wire.read());
       m.Minute = bcdToDec(Wire.read());
@@ -253,6 +352,16 @@ class NixieTubeShield : public LEDControl {
       m.Day = bcdToDec(Wire.read());
       m.Month = bcdToDec(Wire.read());
       m.Year = bcdToDec(Wire.read());
+
+      if (record) {
+        recordRTCTime(m);
+      }
+      return true;
+    }
+
+    void recordRTCTime(const tmElements_t &m) {
+      uint8_t raw[7] = { m.Second, m.Minute, m.Hour, m.Wday, m.Day, m.Month, m.Year };
+      RECORDER.record(REC_RTC, raw, sizeof(raw));
     }
 
     void setRTCDateTime(const tmElements_t &m) {
@@ -299,6 +408,17 @@ class NixieTubeShield : public LEDControl {
     uint16_t digits[6];
 
     bool dotsEnabled = false;
+
+    // Current high voltage PWM duty, outside of a fade
+    int hvLevel = 0;
+
+    // Fade in progress
+    bool _fading = false;
+    bool _fadeState = false;
+    int _fadeFrom = 0;
+    int _fadeDuty = 0;
+    unsigned long _fadeStartTime = 0;
+    unsigned long _fadeMs = 0;
 };
 
 #endif
@@ -0,0 +1,240 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    OTAUpdate.h - Streaming over-the-air firmware updates
+
+    The firmware image is downloaded over HTTP in small chunks and written
+    straight into the inactive OTA partition while its SHA-256 is computed.
+    The expected digest is read from a text file holding the hex digest.
+    The digest of the last image installed is kept in NVS, so a check can
+    tell whether a new image has been published.
+    The download runs in a low priority task on the protocol core so the
+    display loop is not held up.
+
+    Rollback of an image that fails on its first boot requires a bootloader
+    built with CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE. The new image is only
+    marked valid once it has come up and reached the main loop.
+*/
+
+#ifndef OTA_UPDATE_H
+#define OTA_UPDATE_H
+
+#include <HTTPClient.h>
+#include <Preferences.h>
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+
+#define OTA_CHUNK_SIZE     1024 // Bytes read from the network per flash write
+#define OTA_TASK_STACK     8192
+#define OTA_TASK_PRIORITY  (tskIDLE_PRIORITY + 1)
+#define OTA_TASK_CORE      0    // Protocol core, the display loop runs on core 1
+#define OTA_TIMEOUT_MS     10000
+#define OTA_NAMESPACE      "ota"
+
+// OTAUpdate Class Definition
+class OTAUpdate {
+  public:
+    // Mark the running image as good so the bootloader will not roll it back
+    void confirmBoot() {
+      esp_ota_img_states_t state;
+      const esp_partition_t* running = esp_ota_get_running_partition();
+
+      if ((esp_ota_get_state_partition(running, &state) == ESP_OK) &&
+          (state == ESP_OTA_IMG_PENDING_VERIFY)) {
+        Serial.println("OTA image verified, cancelling rollback");
+        esp_ota_mark_app_valid_cancel_rollback();
+      }
+    }
+
+    bool isRunning() {
+      return _running;
+    }
+
+    // Start downloading a firmware image in the background. Returns false
+    // if an update is already in progress.
+    bool start(const char* firmwareUrl, const char* sha256Url) {
+      if (_running) {
+        return false;
+      }
+      _firmwareUrl = firmwareUrl;
+      _sha256Url = sha256Url;
+      _running = true;
+
+      if (xTaskCreatePinnedToCore(updateTask, "ota", OTA_TASK_STACK, this,
+                                  OTA_TASK_PRIORITY, NULL, OTA_TASK_CORE) != pdPASS) {
+        Serial.println("OTA: could not start task");
+        _running = false;
+        return false;
+      }
+      return true;
+    }
+
+    // Returns true if the published digest differs from that of the last
+    // image installed over the air. Blocks while the digest is fetched.
+    bool isUpdateAvailable(const char* sha256Url) {
+      uint8_t expected[32];
+      uint8_t installed[32];
+
+      if (_running) {
+        return false;
+      }
+      _sha256Url = sha256Url;
+      if (!getExpectedDigest(expected)) {
+        return false;
+      }
+
+      Preferences prefs;
+      size_t size = 0;
+      if (prefs.begin(OTA_NAMESPACE, true)) {
+        size = prefs.getBytes("sha256", installed, sizeof(installed));
+        prefs.end();
+      }
+      return (size != sizeof(installed)) || (memcmp(expected, installed, sizeof(installed)) != 0);
+    }
+
+  private:
+    static void updateTask(void* param) {
+      OTAUpdate* ota = static_cast<OTAUpdate*>(param);
+
+      // Keep the CPU at full speed for the download
+      otaPMLock.acquire();
+      bool updated = ota->update();
+      otaPMLock.release();
+
+      if (updated) {
+        Serial.println("OTA: update complete, restarting");
+        delay(100);
+        esp_restart();
+      }
+      ota->_running = false;
+      vTaskDelete(NULL);
+    }
+
+    // Fetch the expected digest as 32 binary bytes
+    bool getExpectedDigest(uint8_t digest[32]) {
+      HTTPClient http;
+      http.setTimeout(OTA_TIMEOUT_MS);
+      http.begin(_sha256Url);
+
+      if (http.GET() != HTTP_CODE_OK) {
+        Serial.println("OTA: could not get SHA-256");
+        http.end();
+        return false;
+      }
+
+      String hex = http.getString();
+      http.end();
+      hex.trim();
+      if (hex.length() < 64) {
+        Serial.println("OTA: bad SHA-256");
+        return false;
+      }
+
+      for (int i = 0; i < 32; i++) {
+        char byteHex[3] = { hex[i * 2], hex[i * 2 + 1], 0 };
+        digest[i] = strtoul(byteHex, NULL, 16);
+      }
+      return true;
+    }
+
+    bool update() {
+      uint8_t expected[32];
+      uint8_t actual[32];
+
+      if (!getExpectedDigest(expected)) {
+        return false;
+      }
+
+      HTTPClient http;
+      http.setTimeout(OTA_TIMEOUT_MS);
+      http.begin(_firmwareUrl);
+
+      if (http.GET() != HTTP_CODE_OK) {
+        Serial.println("OTA: could not get firmware");
+        http.end();
+        return false;
+      }
+
+      int size = http.getSize();
+      if ((size <= 0) || !Update.begin(size, U_FLASH)) {
+        Serial.println("OTA: not enough space for firmware");
+        http.end();
+        return false;
+      }
+
+      Serial.print("OTA: downloading ");
+      Serial.print(size);
+      Serial.println(" bytes");
+
+      mbedtls_sha256_context sha;
+      mbedtls_sha256_init(&sha);
+      mbedtls_sha256_starts_ret(&sha, 0);
+
+      WiFiClient* stream = http.getStreamPtr();
+      unsigned long startTime = millis();
+      unsigned long lastDataTime = startTime;
+      int remaining = size;
+
+      while (remaining > 0) {
+        int available = stream->available();
+        if (available <= 0) {
+          if (!http.connected() || ((millis() - lastDataTime) > OTA_TIMEOUT_MS)) {
+            break;
+          }
+          delay(1);
+          continue;
+        }
+
+        int len = stream->readBytes(buffer, min(available, min(remaining, OTA_CHUNK_SIZE)));
+        mbedtls_sha256_update_ret(&sha, buffer, len);
+        if (Update.write(buffer, len) != (size_t) len) {
+          break;
+        }
+        remaining -= len;
+        lastDataTime = millis();
+      }
+
+      unsigned long elapsed = millis() - startTime;
+      mbedtls_sha256_finish_ret(&sha, actual);
+      mbedtls_sha256_free(&sha);
+      http.end();
+
+      if (remaining > 0) {
+        Serial.println("OTA: download failed");
+        Update.abort();
+        return false;
+      }
+
+      Serial.print("OTA: throughput (KB/s): ");
+      Serial.println(elapsed ? (float) size / elapsed : 0);
+
+      if (memcmp(expected, actual, sizeof(actual)) != 0) {
+        Serial.println("OTA: SHA-256 mismatch");
+        Update.abort();
+        return false;
+      }
+
+      // Switches the boot partition to the new image
+      if (!Update.end()) {
+        Serial.print("OTA: ");
+        Serial.println(Update.errorString());
+        return false;
+      }
+
+      Preferences prefs;
+      prefs.begin(OTA_NAMESPACE, false);
+      prefs.putBytes("sha256", actual, sizeof(actual));
+      prefs.end();
+      return true;
+    }
+
+    const char* _firmwareUrl = NULL;
+    const char* _sha256Url = NULL;
+    volatile bool _running = false;
+
+    // Chunk buffer, the image is never held in RAM
+    uint8_t buffer[OTA_CHUNK_SIZE];
+};
+
+#endif
@@ -0,0 +1,159 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    Occupancy.h - Motion (PIR) sensor based occupancy detection
+*/
+
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <Preferences.h>
+#include <driver/gpio.h>
+#include <esp_sleep.h>
+#include <soc/gpio_struct.h>
+
+#define OCCUPANCY_NAMESPACE "occupancy"
+
+// Occupancy Class Definition
+// The PIR sensor output drives an interrupt which records the time of the
+// last motion. The room is considered occupied for a hold time after that.
+//
+// The interrupt is level triggered, switching between high and low level
+// on each change, because the same pin setting also wakes the chip from
+// automatic light sleep, which only supports level wakeups. Light sleep is
+// mostly reached while the tubes are off, which is when motion matters.
+class Occupancy {
+  public:
+    // Set up the motion sensor input. A negative pin disables the sensor
+    // and the room is then always considered occupied.
+    void begin(int pin, unsigned long holdSec) {
+      _pin = pin;
+      _holdMs = holdSec * 1000UL;
+
+      if (_pin < 0) {
+        return;
+      }
+
+      // Treat power up as motion so the clock starts out on
+      _lastMotionMs = millis();
+
+      pinMode(_pin, INPUT);
+      _isrPin = _pin;
+      attachInterrupt(digitalPinToInterrupt(_pin), onMotion, ONHIGH);
+
+      // Wake from light sleep when the sensor output goes high
+      gpio_wakeup_enable((gpio_num_t) _pin, GPIO_INTR_HIGH_LEVEL);
+      esp_sleep_enable_gpio_wakeup();
+    }
+
+    // Change the time the tubes stay lit after the last motion
+    void setHoldTime(unsigned long holdSec) {
+      _holdMs = holdSec * 1000UL;
+    }
+
+    // True while the sensor output is high, or if motion has been seen
+    // within the hold time. A retriggerable PIR keeps its output high during
+    // sustained motion without giving a new rising edge, so the hold time
+    // counts from when the output last was high.
+    bool isOccupied() {
+      if (_pin < 0) {
+        return true;
+      }
+      if (digitalRead(_pin) == HIGH) {
+        _lastMotionMs = millis();
+        return true;
+      }
+      return (millis() - _lastMotionMs) < _holdMs;
+    }
+
+    // Returns true once for each burst of motion seen since the last call
+    bool takeMotionEvent() {
+      if (!_motionFlag) {
+        return false;
+      }
+      _motionFlag = false;
+      return true;
+    }
+
+    // Number of motion bursts seen since boot
+    unsigned long getMotionCount() {
+      return _motionCount;
+    }
+
+    // Called once a second to account for tube on-time and the on-time
+    // saved by keeping the tubes off in an empty room
+    void accountSecond(bool tubesOn, bool scheduledOn) {
+      if (tubesOn) {
+        _tubeOnSeconds++;
+      } else if (scheduledOn) {
+        _savedSeconds++;
+      }
+    }
+
+    unsigned long getTubeOnSeconds() {
+      return _tubeOnSeconds;
+    }
+
+    unsigned long getSavedSeconds() {
+      return _savedSeconds;
+    }
+
+    // Restore the tube-life counters saved by saveCounters()
+    void loadCounters() {
+      Preferences prefs;
+      if (prefs.begin(OCCUPANCY_NAMESPACE, true)) {
+        _tubeOnSeconds = prefs.getULong("tube_on", 0);
+        _savedSeconds = prefs.getULong("saved", 0);
+        prefs.end();
+      }
+    }
+
+    // Save the tube-life counters. Done rarely to limit flash wear.
+    void saveCounters() {
+      Preferences prefs;
+      prefs.begin(OCCUPANCY_NAMESPACE, false);
+      prefs.putULong("tube_on", _tubeOnSeconds);
+      prefs.putULong("saved", _savedSeconds);
+      prefs.end();
+    }
+
+    // Print tube-life counters
+    void printCounters() {
+      Serial.print("Tube on-time (h): ");
+      Serial.print(_tubeOnSeconds / 3600.0);
+      Serial.print(", saved (h): ");
+      Serial.println(_savedSeconds / 3600.0);
+    }
+
+  private:
+    static void IRAM_ATTR onMotion() {
+      if (GPIO.pin[_isrPin].int_type == GPIO_INTR_HIGH_LEVEL) {
+        // Output went high: motion. Wait for it to go low again.
+        _lastMotionMs = millis();
+        _motionFlag = true;
+        _motionCount++;
+        GPIO.pin[_isrPin].int_type = GPIO_INTR_LOW_LEVEL;
+      } else {
+        GPIO.pin[_isrPin].int_type = GPIO_INTR_HIGH_LEVEL;
+      }
+    }
+
+    int _pin = -1;
+    unsigned long _holdMs = 0;
+
+    unsigned long _tubeOnSeconds = 0;
+    unsigned long _savedSeconds = 0;
+
+    // Shared with the interrupt handler
+    static volatile unsigned long _lastMotionMs;
+    static volatile bool _motionFlag;
+    static volatile unsigned long _motionCount;
+    static int _isrPin;
+};
+
+volatile unsigned long Occupancy::_lastMotionMs = 0;
+volatile bool Occupancy::_motionFlag = false;
+volatile unsigned long Occupancy::_motionCount = 0;
+int Occupancy::_isrPin = 0;
+
+#endif
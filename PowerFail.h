@@ -0,0 +1,190 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    PowerFail.h - Fast state save on supply failure and fast resume
+
+    Two triggers save the clock's state to RTC memory, which survives the
+    reset that follows a supply sag:
+
+      - the ESP32 brownout detector interrupt. The handler runs before the
+        core's own handler restarts the chip, so it only marks the saved
+        state and forces the high voltage enable pin low.
+      - optionally, the 12 V rail falling below a threshold, read through a
+        divider on an ADC1 pin (GPIO 32-39; ADC2 cannot be read while WiFi
+        is on) by a high priority task. This fires well before the 3.3 V
+        rail browns out and forces the pin low the same way. If the rail
+        recovers without a reset, the main loop is told to give the pin
+        back to the PWM.
+
+    Both triggers only touch the GPIO matrix and output registers. The PWM
+    level and the power management locks belong to the main loop and are
+    left alone.
+
+    The saved state holds the second being displayed, so the next boot can
+    tell a fresh save from a stale one and resume the display from the RTC
+    right away instead of waiting for WiFi and NTP.
+*/
+
+#ifndef POWER_FAIL_H
+#define POWER_FAIL_H
+
+#include <driver/rtc_cntl.h>
+#include <esp_rom_gpio.h>
+#include <soc/gpio_struct.h>
+#include <soc/gpio_sig_map.h>
+#include <soc/rtc_cntl_reg.h>
+
+#define POWERFAIL_MAGIC          0x4E495850  // "NIXP"
+#define POWERFAIL_TASK_STACK     2048
+#define POWERFAIL_TASK_PRIORITY  (configMAX_PRIORITIES - 2)
+#define POWERFAIL_TASK_CORE      0
+#define POWERFAIL_POLL_MS        2    // ADC sample interval
+#define POWERFAIL_RECOVER_MS     200  // Rail must be good this long to recover
+#define POWERFAIL_HYSTERESIS_MV  500
+
+// Kept in RTC memory, which is not cleared by a brownout reset
+struct PowerFailState {
+  uint32_t magic;       // POWERFAIL_MAGIC while a save is pending
+  uint32_t saveCount;   // Saves since power on
+  uint32_t countCheck;  // ~saveCount, tells a valid count from garbage
+  uint32_t time;        // Second being displayed
+};
+
+RTC_NOINIT_ATTR PowerFailState powerFailState;
+
+// PowerFail Class Definition
+class PowerFail {
+  public:
+    // Arm the triggers. hvPin is forced low when either fires. A negative
+    // sensePin disables the 12 V rail watch. The rail voltage is the pin
+    // voltage times senseRatio.
+    void begin(int hvPin, int sensePin, float senseRatio, int failMv) {
+      if (powerFailState.countCheck != ~powerFailState.saveCount) {
+        // Power on, RTC memory holds garbage
+        powerFailState.magic = 0;
+        powerFailState.saveCount = 0;
+        powerFailState.countCheck = ~(uint32_t) 0;
+      }
+      _hvPin = hvPin;
+      _sensePin = sensePin;
+      _senseRatio = senseRatio;
+      _failMv = failMv;
+
+      rtc_isr_register(onBrownout, NULL, RTC_CNTL_BROWN_OUT_INT_ENA_M);
+
+      if ((_sensePin >= 0) && ((_sensePin < 32) || (_sensePin > 39))) {
+        Serial.println("Supply sense pin must be an ADC1 pin (GPIO 32-39)");
+        _sensePin = -1;
+      }
+      if (_sensePin >= 0) {
+        analogSetPinAttenuation(_sensePin, ADC_11db);
+        xTaskCreatePinnedToCore(watchTask, "powerfail", POWERFAIL_TASK_STACK, this,
+                                POWERFAIL_TASK_PRIORITY, NULL, POWERFAIL_TASK_CORE);
+      }
+    }
+
+    // True if a save is waiting to be resumed from. Valid before begin().
+    static bool hasSavedState() {
+      return (powerFailState.magic == POWERFAIL_MAGIC) &&
+             (powerFailState.countCheck == ~powerFailState.saveCount);
+    }
+
+    // Take the saved second and clear the save. Returns false if there is none.
+    bool takeSavedTime(time_t& t) {
+      if (!hasSavedState()) {
+        return false;
+      }
+      t = powerFailState.time;
+      powerFailState.magic = 0;
+      return true;
+    }
+
+    // Called once a second with the second being displayed
+    void update(time_t t) {
+      powerFailState.time = t;
+    }
+
+    // Returns true once after the rail recovered without a reset. The high
+    // voltage pin must then be given back to the PWM.
+    bool takeRecovered() {
+      if (!_recovered) {
+        return false;
+      }
+      _recovered = false;
+      return true;
+    }
+
+    unsigned long getSaveCount() {
+      return powerFailState.saveCount;
+    }
+
+  private:
+    static void IRAM_ATTR save() {
+      if (powerFailState.magic != POWERFAIL_MAGIC) {
+        powerFailState.saveCount++;
+        powerFailState.countCheck = ~powerFailState.saveCount;
+        powerFailState.magic = POWERFAIL_MAGIC;
+      }
+    }
+
+    // Take the high voltage pin away from the LEDC and drive it low
+    static void IRAM_ATTR forceHVOff() {
+      if ((_hvPin >= 0) && (_hvPin < 32)) {
+        esp_rom_gpio_connect_out_signal(_hvPin, SIG_GPIO_OUT_IDX, false, false);
+        GPIO.out_w1tc = 1UL << _hvPin;
+      }
+    }
+
+    // Runs in interrupt context just before the restart
+    static void IRAM_ATTR onBrownout(void* arg) {
+      save();
+      forceHVOff();
+    }
+
+    static void watchTask(void* param) {
+      PowerFail* pf = static_cast<PowerFail*>(param);
+      bool failed = false;
+      unsigned long goodSince = 0;
+
+      while (true) {
+        int mv = analogReadMilliVolts(pf->_sensePin) * pf->_senseRatio;
+
+        if (failed) {
+          // Again on every sample, in case the main loop gave the pin back
+          // to the PWM just as the rail fell again
+          forceHVOff();
+        }
+
+        if (!failed && (mv < pf->_failMv)) {
+          save();
+          forceHVOff();
+          failed = true;
+        } else if (failed && (mv >= pf->_failMv + POWERFAIL_HYSTERESIS_MV)) {
+          if (goodSince == 0) {
+            goodSince = millis();
+          } else if ((millis() - goodSince) >= POWERFAIL_RECOVER_MS) {
+            // The sag passed without a reset
+            powerFailState.magic = 0;
+            failed = false;
+            goodSince = 0;
+            pf->_recovered = true;
+          }
+        } else {
+          goodSince = 0;
+        }
+        vTaskDelay(pdMS_TO_TICKS(POWERFAIL_POLL_MS));
+      }
+    }
+
+    static int _hvPin;
+    int _sensePin = -1;
+    float _senseRatio = 1.0;
+    int _failMv = 0;
+    volatile bool _recovered = false;
+};
+
+int PowerFail::_hvPin = -1;
+
+PowerFail POWERFAIL;
+
+#endif
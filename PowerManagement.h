@@ -0,0 +1,211 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    PowerManagement.h - Dynamic frequency scaling and light sleep
+
+    Requires an ESP-IDF build with CONFIG_PM_ENABLE and
+    CONFIG_FREERTOS_USE_TICKLESS_IDLE. Without them esp_pm calls return
+    ESP_ERR_NOT_SUPPORTED and the clock runs at full speed as before.
+*/
+
+#ifndef POWER_MANAGEMENT_H
+#define POWER_MANAGEMENT_H
+
+#include <esp_pm.h>
+
+// Rough supply current figures for the ESP32 module, used to estimate
+// the average current draw from the time spent in each state
+#define PM_CURRENT_MAX_MA    50  // CPU at maximum frequency
+#define PM_CURRENT_APB_MA    25  // CPU at 80MHz with APB clock held
+#define PM_CURRENT_SLEEP_MA   3  // Automatic light sleep
+
+// PMLock Class Definition
+// Wraps an esp_pm lock and keeps track of how long it was held
+class PMLock {
+  public:
+    PMLock(esp_pm_lock_type_t type, const char* name) : _type(type), _name(name) {
+    }
+
+    void acquire() {
+      if (!_created) {
+        // Fails with ESP_ERR_NOT_SUPPORTED when power management is not built in
+        _created = true;
+        esp_pm_lock_create(_type, 0, _name, &_handle);
+      }
+      if (_handle) {
+        esp_pm_lock_acquire(_handle);
+      }
+      if (_count++ == 0) {
+        _acquiredUs = esp_timer_get_time();
+      }
+    }
+
+    void release() {
+      if (_count == 0) {
+        return;
+      }
+      if (--_count == 0) {
+        _heldUs += esp_timer_get_time() - _acquiredUs;
+      }
+      if (_handle) {
+        esp_pm_lock_release(_handle);
+      }
+    }
+
+    // Total time held in microseconds, including the current hold
+    int64_t getHeldUs() {
+      int64_t held = _heldUs;
+      if (_count > 0) {
+        held += esp_timer_get_time() - _acquiredUs;
+      }
+      return held;
+    }
+
+    void resetHeldUs() {
+      _heldUs = 0;
+      if (_count > 0) {
+        _acquiredUs = esp_timer_get_time();
+      }
+    }
+
+  private:
+    esp_pm_lock_type_t _type;
+    const char* _name;
+    esp_pm_lock_handle_t _handle = NULL;
+    bool _created = false;
+    int _count = 0;
+    int64_t _acquiredUs = 0;
+    int64_t _heldUs = 0;
+};
+
+// Held while pushing a frame to the shield over SPI
+PMLock spiPMLock(ESP_PM_CPU_FREQ_MAX, "spi");
+
+// Held while the LED and high voltage PWM outputs are running, since
+// LEDC is clocked from APB and stops in light sleep
+PMLock ledcPMLock(ESP_PM_APB_FREQ_MAX, "ledc");
+
+// Held around network activity (WiFi connect, NTP)
+PMLock netPMLock(ESP_PM_CPU_FREQ_MAX, "net");
+
+// Held by the firmware update task while it downloads. Separate from
+// netPMLock because PMLock is not safe to share between tasks.
+PMLock otaPMLock(ESP_PM_CPU_FREQ_MAX, "ota");
+
+// PowerManager Class Definition
+class PowerManager {
+  public:
+    // Enable dynamic frequency scaling and, optionally, automatic light sleep
+    void begin(int maxFreqMHz, int minFreqMHz, bool lightSleep) {
+      esp_pm_config_esp32_t config;
+      config.max_freq_mhz = maxFreqMHz;
+      config.min_freq_mhz = minFreqMHz;
+      config.light_sleep_enable = lightSleep;
+
+      esp_err_t err = esp_pm_configure(&config);
+      if (err == ESP_OK) {
+        Serial.println("Power management enabled");
+      } else {
+        Serial.print("Power management not available: ");
+        Serial.println(esp_err_to_name(err));
+      }
+      _periodStartUs = esp_timer_get_time();
+    }
+
+    // Called right after the system time has been set. TimeLib counts
+    // seconds from that moment, so the following second boundaries fall
+    // on whole seconds after it, to within a millisecond.
+    void timeSet() {
+      _phaseUs = esp_timer_get_time();
+    }
+
+    // Called when a new second has been detected. The latency is measured
+    // from the second boundary, so it includes the time the main loop took
+    // to notice it, sleeping and polling.
+    void secondEdge() {
+      if (_phaseUs == 0) {
+        return;
+      }
+      int64_t nowUs = esp_timer_get_time();
+      _edgeUs = nowUs - ((nowUs - _phaseUs) % 1000000);
+    }
+
+    // Called after the second's display update. A second that showed no
+    // frame gives no latency sample.
+    void secondHandled() {
+      _edgeUs = 0;
+    }
+
+    // Called when a frame has been latched into the tubes. The first frame
+    // after a second edge gives the display latency for that second.
+    void frameShown() {
+      if (_edgeUs == 0) {
+        return;
+      }
+      uint32_t latencyUs = esp_timer_get_time() - _edgeUs;
+      _edgeUs = 0;
+
+      _latencySumUs += latencyUs;
+      _latencyCount++;
+      if (latencyUs > _latencyMaxUs) {
+        _latencyMaxUs = latencyUs;
+      }
+    }
+
+    // Print lock duty, estimated average current and second edge latency
+    // for the period since the previous report
+    void printReport() {
+      int64_t periodUs = esp_timer_get_time() - _periodStartUs;
+      if (periodUs <= 0) {
+        return;
+      }
+
+      float maxDuty = (float) (spiPMLock.getHeldUs() + netPMLock.getHeldUs() +
+                               otaPMLock.getHeldUs()) / periodUs;
+      float apbDuty = (float) ledcPMLock.getHeldUs() / periodUs;
+      maxDuty = min(maxDuty, 1.0f);
+      apbDuty = max(min(apbDuty, 1.0f) - maxDuty, 0.0f);
+      float sleepDuty = max(1.0f - maxDuty - apbDuty, 0.0f);
+
+      float currentMA = maxDuty * PM_CURRENT_MAX_MA +
+                        apbDuty * PM_CURRENT_APB_MA +
+                        sleepDuty * PM_CURRENT_SLEEP_MA;
+
+      Serial.print("Power: max freq ");
+      Serial.print(maxDuty * 100);
+      Serial.print("%, APB held ");
+      Serial.print(apbDuty * 100);
+      Serial.print("%, sleep allowed ");
+      Serial.print(sleepDuty * 100);
+      Serial.print("%, est. current (mA) ");
+      Serial.println(currentMA);
+
+      Serial.print("Second edge latency (us): avg ");
+      Serial.print(_latencyCount ? _latencySumUs / _latencyCount : 0);
+      Serial.print(", max ");
+      Serial.println(_latencyMaxUs);
+
+      // Start a new period
+      spiPMLock.resetHeldUs();
+      ledcPMLock.resetHeldUs();
+      netPMLock.resetHeldUs();
+      otaPMLock.resetHeldUs();
+      _periodStartUs = esp_timer_get_time();
+      _latencySumUs = 0;
+      _latencyCount = 0;
+      _latencyMaxUs = 0;
+    }
+
+  private:
+    int64_t _periodStartUs = 0;
+    int64_t _phaseUs = 0;
+    int64_t _edgeUs = 0;
+
+    uint64_t _latencySumUs = 0;
+    uint32_t _latencyCount = 0;
+    uint32_t _latencyMaxUs = 0;
+};
+
+PowerManager POWER;
+
+#endif
@@ -0,0 +1,96 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    Settings.h - Run-time settings stored in NVS
+
+    The user configuration defines in the main program provide the defaults.
+    Settings changed remotely are saved and override them from then on.
+*/
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <Preferences.h>
+
+#define SETTINGS_NAMESPACE "settings"
+
+// Settings Class Definition
+class Settings {
+  public:
+    bool hourFormat12;
+    bool suppressLeadingZeros;
+    int clockOnHour;
+    int clockOffHour;
+    int motionHoldMin;
+    int ledBrightness;  // 0-255
+    long ledColor;      // 0xRRGGBB, or -1 for the color of the hour
+
+    // Load settings from NVS, falling back to the given defaults
+    void begin(bool defHourFormat12, bool defSuppressLeadingZeros,
+               int defClockOnHour, int defClockOffHour, int defMotionHoldMin,
+               int defLedBrightness) {
+      _prefs.begin(SETTINGS_NAMESPACE, false);
+      hourFormat12         = _prefs.getBool("hour12", defHourFormat12);
+      suppressLeadingZeros = _prefs.getBool("zeros", defSuppressLeadingZeros);
+      clockOnHour          = _prefs.getInt("on_hour", defClockOnHour);
+      clockOffHour         = _prefs.getInt("off_hour", defClockOffHour);
+      motionHoldMin        = _prefs.getInt("motion_hold", defMotionHoldMin);
+      ledBrightness        = _prefs.getInt("brightness", defLedBrightness);
+      ledColor             = _prefs.getLong("color", -1);
+    }
+
+    // Returns false if the name is unknown or the value is out of range
+    static bool isValid(const char* name, long value) {
+      if ((strcmp(name, "hour12") == 0) || (strcmp(name, "zeros") == 0)) {
+        return true;
+      } else if (strcmp(name, "on_hour") == 0) {
+        return (value >= 0) && (value < 24);
+      } else if (strcmp(name, "off_hour") == 0) {
+        return (value >= 0) && (value <= 24);
+      } else if (strcmp(name, "motion_hold") == 0) {
+        // At most a day, so the hold time in ms fits 32 bits
+        return (value > 0) && (value <= 24 * 60);
+      } else if (strcmp(name, "brightness") == 0) {
+        return (value >= 0) && (value <= 255);
+      } else if (strcmp(name, "color") == 0) {
+        return (value >= -1) && (value <= 0xFFFFFF);
+      }
+      return false;
+    }
+
+    // Set a setting by name and save it. Returns false if the name is
+    // unknown or the value is out of range.
+    bool set(const char* name, long value) {
+      if (!isValid(name, value)) {
+        return false;
+      }
+      if (strcmp(name, "hour12") == 0) {
+        hourFormat12 = (value != 0);
+        _prefs.putBool("hour12", hourFormat12);
+      } else if (strcmp(name, "zeros") == 0) {
+        suppressLeadingZeros = (value != 0);
+        _prefs.putBool("zeros", suppressLeadingZeros);
+      } else if (strcmp(name, "on_hour") == 0) {
+        clockOnHour = value;
+        _prefs.putInt("on_hour", clockOnHour);
+      } else if (strcmp(name, "off_hour") == 0) {
+        clockOffHour = value;
+        _prefs.putInt("off_hour", clockOffHour);
+      } else if (strcmp(name, "motion_hold") == 0) {
+        motionHoldMin = value;
+        _prefs.putInt("motion_hold", motionHoldMin);
+      } else if (strcmp(name, "brightness") == 0) {
+        ledBrightness = value;
+        _prefs.putInt("brightness", ledBrightness);
+      } else {
+        ledColor = value;
+        _prefs.putLong("color", ledColor);
+      }
+      return true;
+    }
+
+  private:
+    Preferences _prefs;
+};
+
+#endif
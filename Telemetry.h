@@ -0,0 +1,215 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    Telemetry.h - MQTT telemetry and command channel
+
+    Events and metrics are collected into one JSON message per interval.
+    Messages wait in a bounded ring until the broker acknowledges them
+    (QoS 1), so telemetry gathered while the broker is unreachable is
+    replayed on reconnect. When the ring is full the oldest message is
+    dropped. Commands arrive on the command topic and are handed to the
+    main loop one at a time.
+
+    Uses the AsyncMqttClient library, so connecting and publishing never
+    block the display loop.
+*/
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <AsyncMqttClient.h>
+
+#define TELEMETRY_RING_SIZE     16   // Messages kept while the broker is unreachable
+#define TELEMETRY_MESSAGE_SIZE  384
+#define TELEMETRY_COMMAND_SIZE  64
+#define TELEMETRY_RECONNECT_MS  30000
+
+// Telemetry Class Definition
+class Telemetry {
+  public:
+    // Set up the client. An empty broker host disables MQTT.
+    void begin(const char* host, uint16_t port, const char* serial) {
+      if (strlen(host) == 0) {
+        return;
+      }
+      _enabled = true;
+
+      snprintf(_clientId, sizeof(_clientId), "nixieclock-%s", serial);
+      snprintf(_telemetryTopic, sizeof(_telemetryTopic), "nixieclock/%s/telemetry", serial);
+      snprintf(_commandTopic, sizeof(_commandTopic), "nixieclock/%s/cmd", serial);
+
+      _client.setServer(host, port);
+      _client.setClientId(_clientId);
+      _client.onConnect([this](bool sessionPresent) { onConnect(); });
+      _client.onDisconnect([this](AsyncMqttClientDisconnectReason reason) { onDisconnect(); });
+      _client.onPublish([this](uint16_t packetId) { onPublish(packetId); });
+      _client.onMessage([this](char* topic, char* payload, AsyncMqttClientMessageProperties properties,
+                               size_t len, size_t index, size_t total) {
+        onMessage(payload, len, index, total);
+      });
+    }
+
+    // Record an event for the next batch
+    void event(const char* name) {
+      if (!_enabled) {
+        return;
+      }
+      int len = strlen(_events);
+      if (len + strlen(name) + 4 > sizeof(_events)) {
+        // Batch is full, drop the event rather than truncate it
+        return;
+      }
+      snprintf(_events + len, sizeof(_events) - len, "%s\"%s\"", len ? "," : "", name);
+    }
+
+    // Called from the main loop. Reconnects when needed and sends queued messages.
+    void loop() {
+      if (!_enabled) {
+        return;
+      }
+
+      if (!_connected) {
+        if ((WiFi.status() == WL_CONNECTED) && (millis() - _lastConnectAttempt > TELEMETRY_RECONNECT_MS)) {
+          _lastConnectAttempt = millis();
+          _client.connect();
+        }
+        return;
+      }
+
+      // Drop acknowledged messages from the tail and send new ones
+      portENTER_CRITICAL(&_mux);
+      while ((_count > 0) && _ring[_tail].acked) {
+        _tail = (_tail + 1) % TELEMETRY_RING_SIZE;
+        _count--;
+      }
+      portEXIT_CRITICAL(&_mux);
+
+      for (int i = 0; i < _count; i++) {
+        Message& msg = _ring[(_tail + i) % TELEMETRY_RING_SIZE];
+        if (msg.packetId == 0) {
+          msg.packetId = _client.publish(_telemetryTopic, 1, false, msg.payload);
+          if (msg.packetId == 0) {
+            // Output buffer full, try again next time
+            break;
+          }
+        }
+      }
+    }
+
+    // Queue the batch of events collected so far together with a metrics
+    // snapshot. The metrics are passed in as a JSON object body.
+    void publishBatch(time_t timestamp, const char* metrics) {
+      if (!_enabled) {
+        return;
+      }
+
+      portENTER_CRITICAL(&_mux);
+      if (_count == TELEMETRY_RING_SIZE) {
+        // Drop the oldest message
+        _tail = (_tail + 1) % TELEMETRY_RING_SIZE;
+        _count--;
+        _dropped++;
+      }
+      Message& msg = _ring[(_tail + _count) % TELEMETRY_RING_SIZE];
+      msg.packetId = 0;
+      msg.acked = false;
+      portEXIT_CRITICAL(&_mux);
+
+      snprintf(msg.payload, sizeof(msg.payload),
+               "{\"time\":%ld,\"dropped\":%lu,\"events\":[%s],\"metrics\":{%s}}",
+               (long) timestamp, _dropped, _events, metrics);
+      _events[0] = 0;
+
+      portENTER_CRITICAL(&_mux);
+      _count++;
+      portEXIT_CRITICAL(&_mux);
+    }
+
+    // Copies out the next pending command, if any
+    bool takeCommand(char* command, size_t size) {
+      if (!_commandReady) {
+        return false;
+      }
+      strlcpy(command, _command, size);
+      _commandReady = false;
+      return true;
+    }
+
+    bool isConnected() {
+      return _connected;
+    }
+
+  private:
+    struct Message {
+      uint16_t packetId;  // 0 until handed to the client
+      bool acked;
+      char payload[TELEMETRY_MESSAGE_SIZE];
+    };
+
+    void onConnect() {
+      Serial.println("MQTT connected");
+      _client.subscribe(_commandTopic, 1);
+      _connected = true;
+    }
+
+    void onDisconnect() {
+      _connected = false;
+
+      // Messages not yet acknowledged are sent again after reconnecting
+      portENTER_CRITICAL(&_mux);
+      for (int i = 0; i < _count; i++) {
+        Message& msg = _ring[(_tail + i) % TELEMETRY_RING_SIZE];
+        if (!msg.acked) {
+          msg.packetId = 0;
+        }
+      }
+      portEXIT_CRITICAL(&_mux);
+    }
+
+    void onPublish(uint16_t packetId) {
+      portENTER_CRITICAL(&_mux);
+      for (int i = 0; i < _count; i++) {
+        Message& msg = _ring[(_tail + i) % TELEMETRY_RING_SIZE];
+        if (msg.packetId == packetId) {
+          msg.acked = true;
+          break;
+        }
+      }
+      portEXIT_CRITICAL(&_mux);
+    }
+
+    void onMessage(const char* payload, size_t len, size_t index, size_t total) {
+      // Only whole, short commands are accepted and only one is held at a time
+      if (_commandReady || (index != 0) || (len != total) || (len >= TELEMETRY_COMMAND_SIZE)) {
+        return;
+      }
+      memcpy(_command, payload, len);
+      _command[len] = 0;
+      _commandReady = true;
+    }
+
+    AsyncMqttClient _client;
+    bool _enabled = false;
+    volatile bool _connected = false;
+    unsigned long _lastConnectAttempt = -TELEMETRY_RECONNECT_MS;
+
+    char _clientId[32];
+    char _telemetryTopic[48];
+    char _commandTopic[48];
+
+    // Events collected for the next batch
+    char _events[128] = "";
+
+    // Ring of messages waiting for acknowledgement
+    portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+    Message _ring[TELEMETRY_RING_SIZE];
+    int _tail = 0;
+    int _count = 0;
+    unsigned long _dropped = 0;
+
+    // Pending command
+    char _command[TELEMETRY_COMMAND_SIZE];
+    volatile bool _commandReady = false;
+};
+
+#endif
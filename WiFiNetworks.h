@@ -0,0 +1,173 @@
+/*
+    ESP32 NTP Nixie Tube Clock Program
+
+    WiFiNetworks.h - List of known WiFi networks
+
+    Credentials for several networks are kept in NVS. Before connecting, one
+    scan is made in the background (and cached for a while) and the known
+    networks are ranked by signal strength. Known networks that were not
+    seen in the scan are kept at the end of the list in case their SSID is
+    hidden.
+*/
+
+#ifndef WIFI_NETWORKS_H
+#define WIFI_NETWORKS_H
+
+#include <Preferences.h>
+
+#define WIFI_MAX_NETWORKS     5
+#define WIFI_SCAN_CACHE_MS    (5 * 60 * 1000UL)
+#define WIFI_NETWORKS_NAMESPACE "wifi"
+
+// WiFiNetworks Class Definition
+class WiFiNetworks {
+  public:
+    struct Network {
+      char ssid[33];
+      char password[65];
+    };
+
+    struct Candidate {
+      int network;      // Index into the known networks
+      int32_t rssi;     // Signal strength, or INT32_MIN if not seen
+      uint8_t bssid[6]; // Strongest access point for the network
+      int32_t channel;
+    };
+
+    // Load the known networks. The network in the STA config slot (set by
+    // earlier firmware or WiFiManager) is added if it is not known yet.
+    void begin(const String& staSSID, const String& staPassword) {
+      _prefs.begin(WIFI_NETWORKS_NAMESPACE, false);
+      _count = min((int) _prefs.getUChar("count", 0), WIFI_MAX_NETWORKS);
+      for (int i = 0; i < _count; i++) {
+        _prefs.getBytes(key("net", i), &_networks[i], sizeof(Network));
+      }
+      if (staSSID.length() > 0) {
+        add(staSSID.c_str(), staPassword.c_str());
+      }
+    }
+
+    int count() {
+      return _count;
+    }
+
+    // Add a network or update its password. When the list is full the
+    // oldest network is dropped.
+    void add(const char* ssid, const char* password) {
+      int i = find(ssid);
+      if (i < 0) {
+        if (_count == WIFI_MAX_NETWORKS) {
+          memmove(&_networks[0], &_networks[1], (WIFI_MAX_NETWORKS - 1) * sizeof(Network));
+          _count--;
+        }
+        i = _count++;
+      } else if (strcmp(_networks[i].password, password) == 0) {
+        // Nothing changed
+        return;
+      }
+
+      strlcpy(_networks[i].ssid, ssid, sizeof(_networks[i].ssid));
+      strlcpy(_networks[i].password, password, sizeof(_networks[i].password));
+      save();
+      _scanTime = 0;
+    }
+
+    // Start a background scan for networks, unless a recent scan is cached
+    void startScan() {
+      if ((_scanTime != 0) && ((millis() - _scanTime) < WIFI_SCAN_CACHE_MS)) {
+        return;
+      }
+      _scanTime = 0;
+      WiFi.scanNetworks(true);
+    }
+
+    // Returns -1 while the scan is running, otherwise the number of
+    // candidates, the known networks ranked by signal strength
+    int scanResult() {
+      if (_scanTime != 0) {
+        return _candidateCount;
+      }
+      int found = WiFi.scanComplete();
+      if (found == WIFI_SCAN_RUNNING) {
+        return -1;
+      }
+      // A failed scan leaves every known network unseen
+      found = max(found, 0);
+      _scanTime = millis();
+
+      _candidateCount = 0;
+      for (int n = 0; n < _count; n++) {
+        Candidate& candidate = _candidates[_candidateCount++];
+        candidate.network = n;
+        candidate.rssi = INT32_MIN;
+        candidate.channel = 0;
+
+        // Pick the strongest access point for this network
+        for (int i = 0; i < found; i++) {
+          if ((WiFi.SSID(i) == _networks[n].ssid) && (WiFi.RSSI(i) > candidate.rssi)) {
+            candidate.rssi = WiFi.RSSI(i);
+            candidate.channel = WiFi.channel(i);
+            memcpy(candidate.bssid, WiFi.BSSID(i), sizeof(candidate.bssid));
+          }
+        }
+      }
+      WiFi.scanDelete();
+
+      // Strongest first
+      for (int i = 1; i < _candidateCount; i++) {
+        for (int j = i; (j > 0) && (_candidates[j].rssi > _candidates[j - 1].rssi); j--) {
+          Candidate t = _candidates[j];
+          _candidates[j] = _candidates[j - 1];
+          _candidates[j - 1] = t;
+        }
+      }
+      return _candidateCount;
+    }
+
+    // Forget the cached scan, e.g. after all candidates failed
+    void invalidateScan() {
+      _scanTime = 0;
+    }
+
+    const Candidate& getCandidate(int i) {
+      return _candidates[i];
+    }
+
+    const Network& getNetwork(int i) {
+      return _networks[i];
+    }
+
+  private:
+    int find(const char* ssid) {
+      for (int i = 0; i < _count; i++) {
+        if (strcmp(_networks[i].ssid, ssid) == 0) {
+          return i;
+        }
+      }
+      return -1;
+    }
+
+    void save() {
+      for (int i = 0; i < _count; i++) {
+        _prefs.putBytes(key("net", i), &_networks[i], sizeof(Network));
+      }
+      _prefs.putUChar("count", _count);
+    }
+
+    static const char* key(const char* prefix, int i) {
+      static char name[8];
+      snprintf(name, sizeof(name), "%s%d", prefix, i);
+      return name;
+    }
+
+    Preferences _prefs;
+
+    Network _networks[WIFI_MAX_NETWORKS];
+    int _count = 0;
+
+    Candidate _candidates[WIFI_MAX_NETWORKS];
+    int _candidateCount = 0;
+    unsigned long _scanTime = 0;
+};
+
+#endif
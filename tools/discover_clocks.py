@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""
+    ESP32 NTP Nixie Tube Clock Program
+
+    discover_clocks.py - List the Nixie clocks on the local network
+
+    Sends one DNS-SD browse for _nixieclock._tcp and prints every clock that
+    answers together with its TXT records (firmware version, sync state and
+    serial number). Requires the zeroconf package (pip install zeroconf).
+"""
+
+import argparse
+import time
+
+from zeroconf import ServiceBrowser, ServiceListener, Zeroconf
+
+SERVICE_TYPE = "_nixieclock._tcp.local."
+
+
+class ClockListener(ServiceListener):
+    def __init__(self):
+        self.names = set()
+
+    def add_service(self, zc, type_, name):
+        self.names.add(name)
+
+    def update_service(self, zc, type_, name):
+        self.names.add(name)
+
+    def remove_service(self, zc, type_, name):
+        self.names.discard(name)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="List the Nixie clocks on the local network")
+    parser.add_argument("-t", "--timeout", type=float, default=3.0,
+                        help="seconds to wait for answers (default 3)")
+    args = parser.parse_args()
+
+    zc = Zeroconf()
+    listener = ClockListener()
+    ServiceBrowser(zc, SERVICE_TYPE, listener)
+    time.sleep(args.timeout)
+
+    print("%-22s %-16s %-6s %-8s %-6s %s" % ("HOST", "ADDRESS", "PORT", "FW", "SYNC", "SERIAL"))
+    for name in sorted(listener.names):
+        # Answers carry SRV, TXT and A records, so this is served from the cache
+        info = zc.get_service_info(SERVICE_TYPE, name, timeout=int(args.timeout * 1000))
+        if info is None:
+            continue
+        txt = {k.decode(): (v or b"").decode() for k, v in info.properties.items()}
+        addresses = info.parsed_addresses()
+        print("%-22s %-16s %-6d %-8s %-6s %s" % (
+            info.server.rstrip("."),
+            addresses[0] if addresses else "-",
+            info.port,
+            txt.get("fw", "-"),
+            txt.get("sync", "-"),
+            txt.get("serial", "-")))
+    print("%d clock(s) found" % len(listener.names))
+
+    zc.close()
+
+
+if __name__ == "__main__":
+    main()
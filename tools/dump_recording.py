@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+    ESP32 NTP Nixie Tube Clock Program
+
+    dump_recording.py - Decode an input recording made by the clock
+    (see InputRecorder.h)
+
+    Prints one line per recorded input with its time since the start of
+    the recording. With --check, only reports problems such as seconds
+    that were skipped or repeated between timer fires.
+"""
+
+import argparse
+import struct
+import sys
+from datetime import datetime, timezone
+
+MAGIC = b"NXR1"
+
+REC_BUTTON = 1
+REC_NTP = 2
+REC_RTC = 3
+REC_WIFI = 4
+REC_SECOND = 5
+REC_MOTION = 6
+
+PAYLOAD_SIZE = {REC_BUTTON: 2, REC_NTP: 48, REC_RTC: 7, REC_WIFI: 1, REC_SECOND: 4,
+                REC_MOTION: 1}
+BUTTONS = ("set", "up", "down")
+
+
+def records(data):
+    if data[:4] != MAGIC:
+        raise ValueError("not a recording")
+    pos, t_us = 4, 0
+    while pos < len(data):
+        rec_type = data[pos]
+        pos += 1
+        if rec_type not in PAYLOAD_SIZE:
+            raise ValueError("bad record type %d at offset %d" % (rec_type, pos - 1))
+        delta, shift = 0, 0
+        while True:
+            b = data[pos]
+            pos += 1
+            delta |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                break
+        t_us += delta
+        size = PAYLOAD_SIZE[rec_type]
+        if pos + size > len(data):
+            raise ValueError("truncated record at offset %d" % pos)
+        yield t_us, rec_type, data[pos:pos + size]
+        pos += size
+
+
+def describe(rec_type, payload):
+    if rec_type == REC_BUTTON:
+        clicks = struct.unpack("<b", payload[1:2])[0]
+        return "button %s clicks %d" % (BUTTONS[payload[0]], clicks)
+    if rec_type == REC_NTP:
+        secs = struct.unpack(">I", payload[40:44])[0] - 2208988800
+        return "ntp transmit %s" % datetime.fromtimestamp(secs, timezone.utc).isoformat()
+    if rec_type == REC_RTC:
+        # tmElements_t years count from 1970
+        s, m, h, wd, d, mo, y = payload
+        return "rtc %04d-%02d-%02d %02d:%02d:%02d" % (1970 + y, mo, d, h, m, s)
+    if rec_type == REC_WIFI:
+        return "wifi event %d" % payload[0]
+    if rec_type == REC_MOTION:
+        return "motion %d" % payload[0]
+    secs = struct.unpack("<I", payload)[0]
+    return "second %s" % datetime.fromtimestamp(secs, timezone.utc).isoformat()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode an input recording made by the Nixie clock")
+    parser.add_argument("recording", help="recording downloaded from GET /record")
+    parser.add_argument("--check", action="store_true",
+                        help="only report skipped or repeated seconds")
+    args = parser.parse_args()
+
+    with open(args.recording, "rb") as f:
+        data = f.read()
+
+    problems = 0
+    prev_second = None
+    for t_us, rec_type, payload in records(data):
+        if not args.check:
+            print("%12.6f  %s" % (t_us / 1e6, describe(rec_type, payload)))
+        if rec_type == REC_SECOND:
+            second = struct.unpack("<I", payload)[0]
+            if prev_second is not None and second != prev_second + 1:
+                problems += 1
+                print("%12.6f  second went from %d to %d" % (t_us / 1e6, prev_second, second))
+            prev_second = second
+
+    if args.check:
+        print("%d problem(s) found" % problems)
+    sys.exit(1 if problems else 0)
+
+
+if __name__ == "__main__":
+    main()
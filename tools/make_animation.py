@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""
+    ESP32 NTP Nixie Tube Clock Program
+
+    make_animation.py - Convert CSV or JSON animations into the clock's
+    compressed frame-stream format (see Animation.h)
+
+    CSV input has one frame per row with the columns
+        digits,dots,red,green,blue,ms
+    where digits is six characters, 0-9 or '-' for a blank tube.
+    JSON input is a list of objects
+        {"digits": "12-456", "dots": 1, "color": [r, g, b], "ms": 100}
+    Fields missing from a JSON frame keep their previous value.
+
+    Prints the compression ratio against a raw 12 byte frame and the
+    average number of bytes decoded per frame.
+"""
+
+import argparse
+import csv
+import json
+import struct
+import sys
+
+MAGIC = b"NXA1"
+RAW_FRAME_SIZE = 12  # 6 digits, dots, 3 color bytes, 2 byte duration
+
+FLAG_DIGITS = 0x01
+FLAG_DOTS = 0x02
+FLAG_COLOR = 0x04
+FLAG_SHORT_TIME = 0x08
+
+BLANK_DIGIT = 10
+
+
+def parse_digits(text):
+    if len(text) != 6:
+        raise ValueError("digits must have 6 characters: %r" % text)
+    return tuple(BLANK_DIGIT if c == "-" else int(c) for c in text)
+
+
+def read_csv(path):
+    frames = []
+    with open(path, newline="") as f:
+        for row in csv.reader(f):
+            if not row or row[0].startswith("#") or row[0] == "digits":
+                continue
+            digits, dots, red, green, blue, ms = row
+            frames.append((parse_digits(digits.strip()), int(dots) != 0,
+                           (int(red), int(green), int(blue)), int(ms)))
+    return frames
+
+
+def read_json(path):
+    frames = []
+    digits, dots, color = (BLANK_DIGIT,) * 6, False, (0, 0, 0)
+    with open(path) as f:
+        for item in json.load(f):
+            digits = parse_digits(item["digits"]) if "digits" in item else digits
+            dots = bool(item.get("dots", dots))
+            color = tuple(item.get("color", color))
+            frames.append((digits, dots, color, int(item["ms"])))
+    return frames
+
+
+def merge_runs(frames):
+    # Identical consecutive frames become one longer frame
+    merged = []
+    for frame in frames:
+        if merged and merged[-1][:3] == frame[:3] and merged[-1][3] + frame[3] <= 0xFFFF:
+            merged[-1] = merged[-1][:3] + (merged[-1][3] + frame[3],)
+        else:
+            merged.append(frame)
+    return merged
+
+
+def encode(frames):
+    out = bytearray(MAGIC + struct.pack("<H", len(frames)))
+    prev = None
+    for digits, dots, color, ms in frames:
+        flags = 0
+        body = bytearray()
+        if prev is None or digits != prev[0]:
+            flags |= FLAG_DIGITS
+            body += bytes((digits[i] << 4) | digits[i + 1] for i in range(0, 6, 2))
+        if prev is None or dots != prev[1]:
+            flags |= FLAG_DOTS
+            body.append(1 if dots else 0)
+        if prev is None or color != prev[2]:
+            flags |= FLAG_COLOR
+            body += bytes(color)
+        if ms < 256:
+            flags |= FLAG_SHORT_TIME
+            body.append(ms)
+        else:
+            body += struct.pack("<H", min(ms, 0xFFFF))
+        out.append(flags)
+        out += body
+        prev = (digits, dots, color)
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a CSV or JSON animation for the Nixie clock")
+    parser.add_argument("input", help="animation in .csv or .json format")
+    parser.add_argument("output", help="output file, upload to the clock with POST /anim")
+    args = parser.parse_args()
+
+    frames = read_json(args.input) if args.input.endswith(".json") else read_csv(args.input)
+    if not frames:
+        sys.exit("no frames in " + args.input)
+
+    merged = merge_runs(frames)
+    data = encode(merged)
+    with open(args.output, "wb") as f:
+        f.write(data)
+
+    raw = len(frames) * RAW_FRAME_SIZE
+    print("%d frames (%d after merging runs), %d bytes, raw %d bytes" %
+          (len(frames), len(merged), len(data), raw))
+    print("Compression ratio: %.2f" % (raw / float(len(data))))
+    print("Decoded bytes per frame: %.2f" % ((len(data) - 6) / float(len(merged))))
+
+
+if __name__ == "__main__":
+    main()